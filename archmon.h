@@ -0,0 +1,103 @@
+/*
+ * Architectural shared resources monitor: interface shared with userspace
+ *
+ * Author: Jeongseob Ahn (ahnjeong@umich.edu) 
+ */
+#ifndef _ARCHMON_H
+#define _ARCHMON_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define ARCHMON_DEV		"/dev/archmon"
+
+/*
+ * Telemetry rings
+ *
+ * /dev/archmon maps one ring per possible CPU, the ring of CPU n starts at
+ * offset n * ARCHMON_RING_BYTES. The period timer of each CPU is the only
+ * producer of its ring and appends one record per period.
+ *
+ * Reader protocol, no syscall per record:
+ *	head = load_acquire(&ring->head);
+ *	while ( tail != head ) consume ring->records[tail++ & (size - 1)];
+ *	store_release(&ring->tail, tail);
+ *
+ * The kernel drops records (and counts them in 'lost') instead of
+ * overwriting records the reader has not consumed yet. poll() reports
+ * POLLIN once any ring holds 'watermark' (module parameter) records.
+ */
+#define ARCHMON_RING_SIZE	1024
+#define ARCHMON_RING_BYTES	(64 * 1024)
+
+struct archmon_record {
+	__u64 timestamp;	/* start of the period, ns of CLOCK_MONOTONIC */
+	__u64 used;		/* credit used: LLC misses, or bytes in traffic mode */
+	__u64 credit;		/* credit granted for the period */
+	__u64 throttle_ns;	/* time the CPU spent throttled */
+	__s32 throttled_pid;	/* task throttled during the period, 0 if none */
+	__u32 __pad;
+};
+
+struct archmon_ring {
+	/* Written by the kernel */
+	__u64 head;		/* records produced */
+	__u64 lost;		/* records dropped on a full ring */
+	__u32 size;		/* number of records, a power of two */
+	__u32 cpu;
+	__u8 __pad0[40];
+
+	/* Written by the reader */
+	__u64 tail;		/* records consumed */
+	__u8 __pad1[56];
+
+	struct archmon_record records[];
+};
+
+/*
+ * Control, batched so that a control round costs one ioctl() each way
+ *
+ * ARCHMON_IOC_SET_BUDGETS applies 'nr' budgets at once, all or none of
+ * them, and they take effect at the next period boundary. A CPU or node
+ * budget of 0 goes back to the default share. Groups must already exist
+ * (debugfs groups) and are addressed by slot, see ARCHMON_IOC_GET_GROUPS.
+ *
+ * ARCHMON_IOC_GET_GROUPS fills up to 'nr' group records and returns the
+ * number of groups.
+ */
+#define ARCHMON_MAX_BATCH	1024
+#define ARCHMON_PATH_LEN	128
+
+enum archmon_target {
+	ARCHMON_TARGET_CPU = 0,
+	ARCHMON_TARGET_NODE,
+	ARCHMON_TARGET_GROUP,
+};
+
+struct archmon_budget {
+	__u32 target;		/* enum archmon_target */
+	__u32 id;		/* CPU, node or group slot */
+	__u64 mbps;
+};
+
+struct archmon_group_stat {
+	__u32 slot;
+	__u32 __pad;
+	__u64 mbps;		/* budget in MB/s, 0: set in credit */
+	__u64 budget;		/* credit per period */
+	__u64 usage;		/* credit charged since the group was added */
+	__u64 throttle_count;
+	char path[ARCHMON_PATH_LEN];	/* truncated if longer */
+};
+
+struct archmon_batch {
+	__u32 nr;
+	__u32 __pad;
+	__u64 ptr;		/* array of nr archmon_budget or archmon_group_stat */
+};
+
+#define ARCHMON_IOC_MAGIC	0xAE
+#define ARCHMON_IOC_SET_BUDGETS	_IOW(ARCHMON_IOC_MAGIC, 1, struct archmon_batch)
+#define ARCHMON_IOC_GET_GROUPS	_IOWR(ARCHMON_IOC_MAGIC, 2, struct archmon_batch)
+
+#endif /* _ARCHMON_H */
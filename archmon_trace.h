@@ -0,0 +1,149 @@
+/*
+ * Tracepoints of the memory bandwidth regulator
+ *
+ * Record with e.g. "trace-cmd record -e archmon" or "perf record -e 'archmon:*'"
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM archmon
+
+#if !defined(_ARCHMON_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ARCHMON_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ *	Counter overflow, in NMI context
+ */
+TRACE_EVENT(archmon_overflow,
+
+	TP_PROTO(int cpu, pid_t pid, u64 used, u64 credit),
+
+	TP_ARGS(cpu, pid, used, credit),
+
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(pid_t, pid)
+		__field(u64, used)
+		__field(u64, credit)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->pid = pid;
+		__entry->used = used;
+		__entry->credit = credit;
+	),
+
+	TP_printk("cpu=%d pid=%d used=%llu left=%llu", __entry->cpu, __entry->pid,
+		__entry->used, __entry->credit > __entry->used ? __entry->credit - __entry->used : 0)
+);
+
+/*
+ *	The CPU ran out of credit
+ */
+TRACE_EVENT(archmon_throttle,
+
+	TP_PROTO(int cpu, pid_t pid, int mode, u64 used, u64 period_credit),
+
+	TP_ARGS(cpu, pid, mode, used, period_credit),
+
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(pid_t, pid)
+		__field(int, mode)
+		__field(u64, used)
+		__field(u64, period_credit)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->pid = pid;
+		__entry->mode = mode;
+		__entry->used = used;
+		__entry->period_credit = period_credit;
+	),
+
+	TP_printk("cpu=%d pid=%d mode=%s used=%llu granted=%llu", __entry->cpu, __entry->pid,
+		__entry->mode ? "kthread" : "signal", __entry->used, __entry->period_credit)
+);
+
+/*
+ *	A task is stopped until the boundary (signal mode and groups)
+ */
+TRACE_EVENT(archmon_throttle_task,
+
+	TP_PROTO(int cpu, pid_t pid),
+
+	TP_ARGS(cpu, pid),
+
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(pid_t, pid)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->pid = pid;
+	),
+
+	TP_printk("cpu=%d pid=%d", __entry->cpu, __entry->pid)
+);
+
+TRACE_EVENT(archmon_unthrottle,
+
+	TP_PROTO(int cpu, int nr_tasks, u64 throttle_start),
+
+	TP_ARGS(cpu, nr_tasks, throttle_start),
+
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(int, nr_tasks)
+		__field(u64, throttle_ns)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->nr_tasks = nr_tasks;
+		__entry->throttle_ns = ktime_get_ns() - throttle_start;
+	),
+
+	TP_printk("cpu=%d tasks=%d throttled=%lluns", __entry->cpu, __entry->nr_tasks, __entry->throttle_ns)
+);
+
+/*
+ *	Period boundary: what was used of the last period, what the next gets
+ */
+TRACE_EVENT(archmon_refill,
+
+	TP_PROTO(int cpu, u64 period_start, u64 used, u64 unused, u64 credit),
+
+	TP_ARGS(cpu, period_start, used, unused, credit),
+
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(u64, period_start)
+		__field(u64, used)
+		__field(u64, unused)
+		__field(u64, credit)
+	),
+
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->period_start = period_start;
+		__entry->used = used;
+		__entry->unused = unused;
+		__entry->credit = credit;
+	),
+
+	TP_printk("cpu=%d period=%llu used=%llu unused=%llu credit=%llu", __entry->cpu, __entry->period_start,
+		__entry->used, __entry->unused, __entry->credit)
+);
+
+#endif /* _ARCHMON_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE archmon_trace
+#include <trace/define_trace.h>
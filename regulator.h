@@ -0,0 +1,135 @@
+/*
+ * Credit policy of the bandwidth regulator
+ *
+ * Plain arithmetic on per-period counts, no locking and no kernel state, so
+ * that the module and the userspace simulator (util/archsim) run the very
+ * same policy.
+ *
+ * Author: Jeongseob Ahn (ahnjeong@umich.edu)
+ */
+#ifndef _ARCHMON_REGULATOR_H
+#define _ARCHMON_REGULATOR_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/math64.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+typedef uint64_t u64;
+
+static inline u64 div64_u64(u64 dividend, u64 divisor)
+{
+	return dividend / divisor;
+}
+#endif
+
+#define RECLAIM_CHUNK_SHIFT	3	/* borrow 1/8 of a per-CPU budget at a time */
+#define ADAPT_MAX_SHIFT		4	/* an adaptive window is at most 16 periods */
+#define ADAPT_LOW_SHIFT		2	/* grow the window below 1/4 of the credit */
+#define ADAPT_HIGH_SHIFT	2	/* shrink it above 3/4 */
+#define CACHE_SCALE_SHIFT	10	/* miss budget scale, fixed point */
+
+static inline u64 archmon_min_credit(u64 a, u64 b)
+{
+	return a < b ? a : b;
+}
+
+/*
+ *	Token bucket depth, 0: 'burst_periods' worth of refills
+ */
+static inline u64 archmon_bucket_depth(u64 depth, u64 refill, unsigned int burst_periods)
+{
+	return depth ? depth : refill * burst_periods;
+}
+
+/*
+ *	The overflow path throttles once the credit is used up
+ */
+static inline bool archmon_credit_exhausted(u64 used, u64 credit)
+{
+	return used >= credit;
+}
+
+/*
+ *	Credit of the window starting at a period boundary. The window spans
+ *	1 << period_shift periods, the budget is scaled by cache_scale. With a
+ *	bucket 'depth' (0: no token bucket) unused credit carries over, and the
+ *	per-period 'limit' (0: none) is a hard cap. '*unused' is the credit
+ *	left over from the window that ended, on return what is given away.
+ */
+static inline u64 archmon_refill_credit(u64 credit_per_period, int period_shift, unsigned int cache_scale,
+		u64 depth, u64 limit, u64* unused)
+{
+	u64 credit = ((credit_per_period << period_shift) * cache_scale) >> CACHE_SCALE_SHIFT;
+	u64 carry;
+
+	if ( depth ) {
+		carry = archmon_min_credit(*unused, depth > credit ? depth - credit : 0);
+		credit += carry;
+		*unused -= carry;
+	}
+
+	limit <<= period_shift;
+	if ( limit && credit > limit ) {
+		*unused += credit - limit;
+		credit = limit;
+	}
+
+	return credit;
+}
+
+/*
+ *	Pacing: what may have been used of a window's 'grant' by the end of
+ *	slice 'slice' (from 0) out of 'nr_slices'. 'extra' is what was added
+ *	to the window since, e.g. reclaimed credit, and is not paced.
+ */
+static inline u64 archmon_slice_allowance(u64 grant, u64 extra, unsigned int slice, unsigned int nr_slices)
+{
+	return div64_u64(grant * (slice + 1), nr_slices) + extra;
+}
+
+/*
+ *	Credit a CPU may borrow on top of 'period_credit' at a time: none while
+ *	it is over its cache limit, never past its (window) limit
+ */
+static inline u64 archmon_reclaim_chunk(u64 credit_per_period, u64 period_credit, unsigned int cache_scale, u64 limit)
+{
+	u64 chunk = credit_per_period >> RECLAIM_CHUNK_SHIFT;
+
+	/* Over its cache limit, a CPU must not make up for the smaller budget */
+	if ( cache_scale < (1U << CACHE_SCALE_SHIFT) ) {
+		return 0;
+	}
+
+	if ( limit ) {
+		chunk = archmon_min_credit(chunk, limit > period_credit ? limit - period_credit : 0);
+	}
+
+	return chunk;
+}
+
+/*
+ *	Adaptive period: the next window shift from what was used of the
+ *	'granted' credit. A CPU that used nothing over the longest window goes
+ *	'idle' until it misses again.
+ */
+static inline int archmon_adapt_shift(int period_shift, u64 used, u64 granted, bool* idle)
+{
+	*idle = false;
+
+	if ( used > granted - (granted >> ADAPT_HIGH_SHIFT) ) {
+		return period_shift > 0 ? period_shift - 1 : 0;
+	}
+
+	if ( used < (granted >> ADAPT_LOW_SHIFT) ) {
+		if ( period_shift < ADAPT_MAX_SHIFT ) {
+			return period_shift + 1;
+		}
+		*idle = used == 0;
+	}
+
+	return period_shift;
+}
+
+#endif /* _ARCHMON_REGULATOR_H */
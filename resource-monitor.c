@@ -9,250 +9,3622 @@
 #include <linux/perf_event.h> // perf_event
 #include <linux/hrtimer.h> 
 #include <linux/ktime.h> 
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sched/clock.h>
+#include <linux/irq_work.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/cgroup.h>
+#include <linux/rculist.h>
+#include <linux/hash.h>
+#include <linux/slab.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/fs.h>
+#include <linux/cpuhotplug.h>
+#include <linux/topology.h>
+#include <linux/cache.h>
+#include <linux/workqueue.h>
+#include <asm/local64.h>
+
+#include "archmon.h"
+#include "regulator.h"
+
+#define CREATE_TRACE_POINTS
+#include "archmon_trace.h"
 
 #define AHN_DEBUG 0
 #define TIMER_INTERVAL_US	100000	
+#define MIN_INTERVAL_US		100
+#define MAX_INTERVAL_US		10000000
 #define MAX_BANDWIDTH		8000000		
+#define ARCHMON_MAX_SLICES	64
+#define ADAPT_WAKE_SHIFT	4	/* an idle CPU wakes after 1/16 of a per-CPU budget */
+
+#define ARCHMON_MAX_GROUPS	256
+#define ARCHMON_GROUP_HASH_BITS	8
+#define GROUP_QUANTUM_SHIFT	4	/* charge groups every 1/16 of a per-CPU budget */
+#define GROUP_CHUNK_SHIFT	4	/* CPUs cache 1/16 of a group budget at a time */
+#define ARCHMON_MAX_EXEMPT	16
+
+#define ARCHMON_MAX_EVENTS	3
+#define THROTTLE_SAMPLE_SHIFT	6	/* sample every 1/64 of a per-CPU budget while throttled */
+#define THROTTLE_SAMPLE_MIN	256	/* but not more often than every 256 misses */
+#define PERF_HW_CACHE_CONFIG(cache, op, result)	((cache) | ((op) << 8) | ((result) << 16))
+
+#define ARCHMON_HIST_BUCKETS	32	/* log2 ns, the last one also counts anything longer */
+
+#define ARCHMON_MAX_LLCS	64
+#define ARCHMON_MAX_PACKAGES	8
+#define ARCHMON_MAX_IMCS	16	/* uncore IMC PMUs per socket */
+#define IMC_CAS_BYTES		64
+#define PROBE_MIN_BYTES		(1 << 20)	/* per bandwidth probe thread */
+#define DEFAULT_LLC_KB		8192
+#define CACHE_SCALE_MIN_SHIFT	4	/* never shrink a miss budget below 1/16 */
+
+/* How an over-budget CPU gets throttled */
+enum archmon_throttle_mode {
+	ARCHMON_THROTTLE_SIGNAL = 0,	/* SIGSTOP/SIGCONT the running task */
+	ARCHMON_THROTTLE_KTHREAD,	/* occupy the CPU with a RT throttle thread */
+};
+
+static int throttle_mode = ARCHMON_THROTTLE_SIGNAL;
+module_param(throttle_mode, int, 0644);
+MODULE_PARM_DESC(throttle_mode, "0: SIGSTOP/SIGCONT (default), 1: per-CPU throttle kthread, SIGSTOP while exemptions are set");
+
+static bool exempt_rt = false;
+module_param(exempt_rt, bool, 0644);
+MODULE_PARM_DESC(exempt_rt, "Never throttle RT and deadline tasks");
+
+static int exempt_nice = MIN_NICE - 1;
+module_param(exempt_nice, int, 0644);
+MODULE_PARM_DESC(exempt_nice, "Never throttle tasks at or below this nice level, -21: none");
+
+static bool reclaim = false;
+module_param(reclaim, bool, 0644);
+MODULE_PARM_DESC(reclaim, "Donate unused credit to a global pool and borrow from it before throttling");
+
+static bool adaptive_period = false;
+module_param(adaptive_period, bool, 0644);
+MODULE_PARM_DESC(adaptive_period, "Grow the period of CPUs far below budget, stop the timer of idle ones");
+
+static unsigned int pacing_slices = 1;
+module_param(pacing_slices, uint, 0644);
+MODULE_PARM_DESC(pacing_slices, "Hand out the credit of a period in this many slices, 1: no pacing");
+
+static bool token_bucket = false;
+module_param(token_bucket, bool, 0644);
+MODULE_PARM_DESC(token_bucket, "Carry unused credit over to later periods, up to the bucket depth");
+
+static unsigned int burst_periods = 10;
+module_param(burst_periods, uint, 0644);
+MODULE_PARM_DESC(burst_periods, "Default bucket depth, in periods worth of credit");
+
+static unsigned int telemetry_watermark = ARCHMON_RING_SIZE / 4;
+module_param(telemetry_watermark, uint, 0644);
+MODULE_PARM_DESC(telemetry_watermark, "Telemetry records buffered before poll() wakes the reader");
+
+/* What the credit is charged with */
+enum archmon_count_mode {
+	ARCHMON_COUNT_MISSES = 0,	/* LLC misses, credit in misses */
+	ARCHMON_COUNT_TRAFFIC,		/* weighted read/write(/prefetch) traffic, credit in bytes */
+};
+
+static int count_mode = ARCHMON_COUNT_MISSES;
+module_param(count_mode, int, 0444);
+MODULE_PARM_DESC(count_mode, "0: LLC misses (default), 1: DRAM traffic in bytes");
+
+/* Where the counts come from, see struct archmon_backend */
+enum archmon_backend_type {
+	ARCHMON_BACKEND_HW = 0,		/* LLC events of the core PMU */
+	ARCHMON_BACKEND_SW,		/* a perf software event, for machines without a usable PMU */
+	ARCHMON_BACKEND_SYNTHETIC,	/* misses written to cpuN/inject, for deterministic tests */
+	ARCHMON_NR_BACKENDS,
+};
+
+static int counter_backend = ARCHMON_BACKEND_HW;
+module_param(counter_backend, int, 0444);
+MODULE_PARM_DESC(counter_backend, "0: hardware PMU (default), 1: perf software event, 2: synthetic (debugfs cpuN/inject)");
+
+static unsigned long sw_event = PERF_COUNT_SW_PAGE_FAULTS;
+module_param(sw_event, ulong, 0444);
+MODULE_PARM_DESC(sw_event, "perf software event counted by backend 1, default: page faults");
+
+static bool count_prefetch = false;
+module_param(count_prefetch, bool, 0444);
+MODULE_PARM_DESC(count_prefetch, "Also charge LLC prefetch misses (traffic mode)");
+
+static unsigned long writeback_event = 0;
+module_param(writeback_event, ulong, 0444);
+MODULE_PARM_DESC(writeback_event, "Raw PMU config counting LLC writebacks, 0: generic LLC write misses");
+
+static unsigned int read_weight = 64;
+module_param(read_weight, uint, 0444);
+MODULE_PARM_DESC(read_weight, "Bytes charged per LLC read miss (traffic mode)");
+
+static unsigned int write_weight = 64;
+module_param(write_weight, uint, 0444);
+MODULE_PARM_DESC(write_weight, "Bytes charged per LLC writeback (traffic mode)");
+
+static unsigned int prefetch_weight = 64;
+module_param(prefetch_weight, uint, 0444);
+MODULE_PARM_DESC(prefetch_weight, "Bytes charged per LLC prefetch miss (traffic mode)");
+
+static int imc_pmu_types[ARCHMON_MAX_IMCS];
+static int nr_imc_pmu_types;
+module_param_array(imc_pmu_types, int, &nr_imc_pmu_types, 0444);
+MODULE_PARM_DESC(imc_pmu_types, "perf types of the uncore IMC PMUs (uncore_imc_*/type), none: per-core budgets only");
+
+static unsigned long imc_read_event = 0x0304;
+module_param(imc_read_event, ulong, 0444);
+MODULE_PARM_DESC(imc_read_event, "IMC config counting read CAS commands");
+
+static unsigned long imc_write_event = 0x0c04;
+module_param(imc_write_event, ulong, 0444);
+MODULE_PARM_DESC(imc_write_event, "IMC config counting write CAS commands");
+
+static unsigned int calibrate_ms = 0;
+module_param(calibrate_ms, uint, 0444);
+MODULE_PARM_DESC(calibrate_ms, "Measure the peak bandwidth of every node for this long at load time, 0: don't");
+
+static unsigned int calibrate_pct = 90;
+module_param(calibrate_pct, uint, 0644);
+MODULE_PARM_DESC(calibrate_pct, "Node budgets set by a calibration, in % of the measured peak, 0: leave budgets alone");
+
+static bool calibrate_probe = true;
+module_param(calibrate_probe, bool, 0644);
+MODULE_PARM_DESC(calibrate_probe, "Generate the calibration load in kernel threads, off: from userspace (e.g. util/archbench)");
+
+static unsigned int imc_saturation_mbps = 0;
+module_param(imc_saturation_mbps, uint, 0644);
+MODULE_PARM_DESC(imc_saturation_mbps, "Socket DRAM bandwidth in MB/s below which CPUs are not throttled, 0: always throttle");
+
+static unsigned int llc_kb = 0;
+module_param(llc_kb, uint, 0444);
+MODULE_PARM_DESC(llc_kb, "LLC size in KB used by the occupancy estimate, 0: detect");
+
+/* Latency histograms, bucket i counts [2^i, 2^(i+1)) ns */
+enum archmon_hist_type {
+	ARCHMON_HIST_STOP = 0,		/* budget exhausted until the CPU is taken away */
+	ARCHMON_HIST_THROTTLE,		/* throttled until resumed */
+	ARCHMON_HIST_OVERFLOW,		/* archmon_overflow() */
+	ARCHMON_HIST_TIMER,		/* archmon_period_timer() */
+	ARCHMON_NR_HISTS,
+};
+
+static const char* const archmon_hist_names[ARCHMON_NR_HISTS] = {
+	"stop", "throttle", "overflow", "timer",
+};
+
+struct archmon_hists {
+	local64_t count[ARCHMON_NR_HISTS][ARCHMON_HIST_BUCKETS];
+};
+
+struct archmon_event_desc {
+	const char* name;
+	u32 type;
+	u64 config;
+	unsigned int weight;		/* credit charged per event */
+	bool optional;			/* skipped if the PMU cannot count it */
+	bool fill;			/* brings a line into the LLC */
+};
+
+/*
+ * A cgroup (v2) with its own memory bandwidth budget
+ */
+struct archmon_group {
+	struct cgroup* cgrp;
+	char* path;
+	int slot;			/* index of the per-CPU counters */
+
+	u64 budget;			/* credit per period */
+	u64 mbps;			/* budget in MB/s, converted at every refill, 0: none */
+	u64 depth;			/* token bucket depth, 0: burst_periods * budget */
+	atomic64_t remaining ____cacheline_aligned_in_smp;
+
+	atomic64_t usage;		/* misses charged, folded at period boundaries */
+	atomic64_t throttle_count;
+
+	struct hlist_node hash_node;
+	struct list_head list;
+};
+
+/* A cgroup (v2) whose tasks, descendants included, are never throttled */
+struct archmon_exempt {
+	struct cgroup* cgrp;
+	char* path;
+};
+
+/* A task stopped until the next period boundary */
+struct archmon_throttled_task {
+	struct pid* pid;
+	struct list_head list;
+	bool group;			/* over its group's budget only, resumed once the group is refilled */
+};
+
+/* Per-CPU view of a group, only touched by its own CPU */
+struct pcpu_group_info {
+	u64 used;			/* misses charged since the last boundary */
+	u64 credit;			/* group credit cached on this CPU */
+};
+
+struct pcpu_shared_resources_info {
+	int cpu_id;
+	
+	u64 bw_reserve;			/* credit guaranteed every period, 0: none */
+	u64 bw_limit;			/* credit never exceeded in a period, 0: none */
+
+	u64 cache_reserve;		/* LLC KB protected from other CPUs, 0: none */
+	u64 cache_limit;		/* LLC KB above which the miss budget shrinks, 0: none */
+
+	struct archmon_node* node;	/* NUMA node the credit is drawn from */
+	struct archmon_package* package;	/* socket, NULL: beyond ARCHMON_MAX_PACKAGES */
+
+	/* LLC occupancy estimate, see archmon_cache_period() */
+	int llc_id;
+	u64 llc_occupancy;		/* bytes */
+	u64 llc_measured;		/* ground truth (bytes) from userspace, 0: none */
+	u64 llc_fills_seen;		/* fills of the whole LLC at the last estimate */
+	u64 fill_base;			/* fill count at the start of the period */
+	bool cache_unmet;		/* occupancy below cache_reserve */
+	unsigned int cache_scale;	/* miss budget scale, 1 << CACHE_SCALE_SHIFT: none */
+
+	struct perf_event* perf_events[ARCHMON_MAX_EVENTS];
+	unsigned int event_weights[ARCHMON_MAX_EVENTS];
+	u32 fill_events;		/* bitmap of perf_events that fill the LLC */
+	int nr_perf_events;
+	u64 l3c_miss_sample_period; 
+	bool counting;			/* backend set up, cleared going offline */
+
+	/* Synthetic backend: a counter that only moves when written to */
+	u64 synth_count;		/* misses injected so far */
+	u64 synth_period;		/* misses between overflows */
+	u64 synth_left;			/* misses until the next overflow */
+	u64 synth_charged;		/* count at the last overflow */
+	bool synth_running;
+
+	u64 credit;
+	u64 credit_per_period;
+	u64 credit_base;		/* event count when the credit was granted */
+	u64 credit_override;		/* per-CPU budget, 0: share of total_credit */
+	u64 mbps_override;		/* per-CPU budget in MB/s, takes precedence, 0: none */
+	u64 bucket_depth;		/* token bucket depth, 0: burst_periods * credit_per_period */
+
+	u64 period_base;		/* event count at the start of the period */
+	u64 period_credit;		/* credit granted in this period, reclaim included */
+	u64 period_grant;		/* credit granted at the boundary, reclaim excluded */
+
+	/* Pacing: the period is split in slices, each with its share of the credit */
+	int nr_slices;
+	int slice;			/* current slice */
+	ktime_t period_end;		/* boundary the current period ends at */
+
+	/* Adaptive period: the window is period << period_shift */
+	int period_shift;
+	bool idle;			/* timer stopped until the counters see traffic */
+	bool wake_pending;
+
+	bool throttled;			/* the CPU is out of credit this period */
+	int throttle_mode;		/* mode used by the current throttle */
+	struct list_head throttled_tasks;	/* tasks stopped until the boundary */
+	pid_t throttled_pid;
+	u64 throttle_start;		/* ns */
+
+	struct task_struct* throttle_thread;
+	wait_queue_head_t throttle_evt;
+
+	/* Overflow handler (NMI) only flags the event, the throttle is done here */
+	struct irq_work throttle_work;
+	bool overflow_pending;
+	bool group_pending;		/* the running task's group is over budget */
+	bool reprogram_pending;		/* an event used up its share, the credit is left */
+
+	u64 exhausted_at;		/* local_clock() when the credit ran out */
+
+	/* Overflow handler cost */
+	u64 overflow_count;
+	u64 overflow_ns;
+	u64 overflow_max_ns;
+	
+	struct hrtimer period_timer;
+	ktime_t	period;
+	ktime_t period_start;		/* boundary the current period began at */
+
+	int config_gen;			/* tunables last applied on this CPU */
+	struct dentry* debugfs_dir;
+
+	struct archmon_ring* ring;	/* telemetry, one record per period */
+
+	struct pcpu_group_info groups[ARCHMON_MAX_GROUPS];
+};
+
+/* Shared by the CPUs of one LLC */
+struct archmon_llc {
+	atomic64_t fills;		/* bytes brought into the LLC so far */
+	atomic_t nr_cpus;
+	atomic_t cache_unmet;		/* CPUs below their cache reservation */
+} ____cacheline_aligned_in_smp;
+
+/* DRAM bandwidth of a socket from its uncore IMC counters, if any */
+struct archmon_package {
+	struct perf_event* imc_events[ARCHMON_MAX_IMCS * 2];
+	int nr_imc_events;
+	u64 imc_count;			/* CAS commands at the last sample */
+	u64 imc_stamp;			/* ns of the last sample, 0: none yet */
+	u64 dram_mbps;
+} ____cacheline_aligned_in_smp;
+
+/*
+ *	Per NUMA node budget. Allocated on its own node, so CPUs of different
+ *	sockets never share a cacheline when drawing credit.
+ */
+struct archmon_node {
+	int id;
+	u64 credit;			/* credit per period, 0: share of total_credit */
+	u64 mbps;			/* budget in MB/s, takes precedence, 0: none */
+	atomic_t nr_cpus;
+
+	/* Reservations of its online CPUs, under reserve_lock */
+	u64 total_reserve;
+
+	/* Unused credit donated at period boundaries (reclaim mode) */
+	atomic64_t credit_pool ____cacheline_aligned_in_smp;
+	atomic64_t credit_pool_epoch;	/* boundary (ns) the pool was last emptied at */
+
+	/* Calibration: traffic of the current period, highest in MB/s so far */
+	atomic64_t calibrate_sum ____cacheline_aligned_in_smp;
+	atomic64_t calibrate_epoch;
+	u64 peak_mbps;
+
+	struct dentry* debugfs_dir;
+};
+
+/* A kernel thread streaming through node-local memory during a calibration */
+struct archmon_probe {
+	struct task_struct* task;
+	u64* buf;
+	size_t len;
+	u64 start;			/* ns the thread started at, 0: not yet */
+	u64 bytes;			/* read since */
+};
+
+/*
+ *	Source of the counts the credit is charged with. Calls run on the CPU
+ *	of resource_info, with interrupts off except for init and release.
+ */
+struct archmon_backend {
+	const char* name;
+	int (*init)(struct pcpu_shared_resources_info* resource_info, int cpu_id);
+	void (*release)(struct pcpu_shared_resources_info* resource_info);
+	void (*stop)(struct pcpu_shared_resources_info* resource_info);
+	void (*start)(struct pcpu_shared_resources_info* resource_info);
+	/* Weighted count, 'live' when called from the overflow path */
+	u64 (*read)(struct pcpu_shared_resources_info* resource_info, bool live);
+	/* Count of the events that fill the LLC */
+	u64 (*read_fills)(struct pcpu_shared_resources_info* resource_info);
+	/* Overflow once 'credit' more is counted */
+	void (*set_period)(struct pcpu_shared_resources_info* resource_info, u64 credit);
+};
+
+struct archmon_info {
+
+	struct pcpu_shared_resources_info* __percpu pcpu_resources_info;
+	const struct archmon_backend* backend;
+	u64 total_credit;
+
+	/* Bumped whenever a tunable changes, applied at the next period boundary */
+	atomic_t config_gen;
+	struct dentry* debugfs_dir;
+
+	/* CPUs under regulation, the total credit is split among them */
+	atomic_t nr_cpus;
+	int hp_state;
+
+	/* Budgets and reclaim pools, per NUMA node */
+	struct archmon_node* nodes[MAX_NUMNODES];
+	struct mutex reserve_lock;
+
+	/* Per-CPU latency histograms, kept across hotplug */
+	struct archmon_hists* __percpu hists;
+
+	/* Overflow handler cost of CPUs that went offline */
+	atomic64_t overflow_count;
+	atomic64_t overflow_ns;
+	atomic64_t overflow_max_ns;
+
+	/* Per-cgroup budgets, looked up under RCU from the overflow handler */
+	struct hlist_head group_hash[1 << ARCHMON_GROUP_HASH_BITS];
+	struct list_head group_list;
+	struct archmon_group* groups[ARCHMON_MAX_GROUPS];
+	int nr_groups;
+	struct mutex group_lock;
+
+	/* Throttling allowlist, under group_lock, looked up under RCU */
+	struct archmon_exempt __rcu* exempt[ARCHMON_MAX_EXEMPT];
+	int nr_exempt;
+	atomic64_t group_epoch ____cacheline_aligned_in_smp;	/* boundary (ns) groups were last refilled at */
+
+	/* LLC occupancy estimation */
+	u64 llc_size;			/* bytes */
+	struct archmon_llc llcs[ARCHMON_MAX_LLCS];
+	int llc_keys[ARCHMON_MAX_LLCS];	/* LLC id of each slot in use */
+	int nr_llcs;
+
+	struct archmon_package packages[ARCHMON_MAX_PACKAGES];
+
+	/* Peak bandwidth calibration, see archmon_calibrate_start() */
+	bool calibrating;
+	struct archmon_probe* probes;	/* one per CPU */
+	struct delayed_work calibrate_work;
+	struct mutex calibrate_lock;
+
+	/* Per-CPU telemetry rings mapped by /dev/archmon */
+	void* telemetry;
+	wait_queue_head_t telemetry_wq;
+};
+
+static struct archmon_info g_archmon_info = {
+	.total_credit = MAX_BANDWIDTH,
+	.group_list = LIST_HEAD_INIT(g_archmon_info.group_list),
+	.group_lock = __MUTEX_INITIALIZER(g_archmon_info.group_lock),
+	.reserve_lock = __MUTEX_INITIALIZER(g_archmon_info.reserve_lock),
+	.calibrate_lock = __MUTEX_INITIALIZER(g_archmon_info.calibrate_lock),
+};
+
+static unsigned int period_us = TIMER_INTERVAL_US;
+
+/*
+ *	Runtime tunables
+ */
+static void archmon_config_changed(void)
+{
+	/* Publish the new value before the generation */
+	smp_wmb();
+	atomic_inc(&g_archmon_info.config_gen);
+}
+
+static int archmon_set_period_us(const char* val, const struct kernel_param* kp)
+{
+	unsigned int us;
+	int ret = kstrtouint(val, 0, &us);
+
+	if ( ret ) {
+		return ret;
+	}
+
+	if ( us < MIN_INTERVAL_US || us > MAX_INTERVAL_US ) {
+		return -EINVAL;
+	}
+
+	*(unsigned int*)kp->arg = us;
+	archmon_config_changed();
+	return 0;
+}
+
+static const struct kernel_param_ops period_us_ops = {
+	.set = archmon_set_period_us,
+	.get = param_get_uint,
+};
+module_param_cb(period_us, &period_us_ops, &period_us, 0644);
+MODULE_PARM_DESC(period_us, "Regulation period in us");
+
+/* max_bandwidth was given, MAX_BANDWIDTH is not scaled to traffic mode */
+static bool total_credit_set;
+
+static int archmon_set_total_credit(const char* val, const struct kernel_param* kp)
+{
+	int ret = param_set_ullong(val, kp);
+
+	if ( ret == 0 ) {
+		if ( kp->arg == &g_archmon_info.total_credit ) {
+			total_credit_set = true;
+		}
+		archmon_config_changed();
+	}
+	return ret;
+}
+
+static const struct kernel_param_ops total_credit_ops = {
+	.set = archmon_set_total_credit,
+	.get = param_get_ullong,
+};
+module_param_cb(max_bandwidth, &total_credit_ops, &g_archmon_info.total_credit, 0644);
+MODULE_PARM_DESC(max_bandwidth, "Total credit (LLC misses, bytes in traffic mode) per period, split evenly over CPUs");
+
+static unsigned long long max_bandwidth_mbps = 0;
+module_param_cb(max_bandwidth_mbps, &total_credit_ops, &max_bandwidth_mbps, 0644);
+MODULE_PARM_DESC(max_bandwidth_mbps, "Total budget in MB/s, takes precedence over max_bandwidth, 0: none");
+
+/*
+ *	Budgets in MB/s (10^6 bytes/s) are converted with the period they apply
+ *	to, so they stay exact when the period is retuned: MB/s * us = bytes.
+ *	A credit is an LLC miss (a cache line) or, in traffic mode, a byte.
+ */
+static u64 archmon_bytes_per_credit(void)
+{
+	return count_mode == ARCHMON_COUNT_MISSES ? cache_line_size() : 1;
+}
+
+static u64 archmon_mbps_to_credit(u64 mbps, u64 us)
+{
+	return div64_u64(mbps * us, archmon_bytes_per_credit());
+}
+
+static u64 archmon_credit_to_mbps(u64 credit, u64 us)
+{
+	return div64_u64(credit * archmon_bytes_per_credit(), max_t(u64, us, 1));
+}
+
+/*
+ *	Credit per period of a node: its own budget, or the share of the
+ *	total credit its CPUs would get
+ */
+static u64 archmon_node_credit(struct archmon_node* node, u64 us)
+{
+	u64 credit = READ_ONCE(node->mbps);
+	u64 total_credit = READ_ONCE(g_archmon_info.total_credit);
+
+	if ( credit ) {
+		return archmon_mbps_to_credit(credit, us);
+	}
+
+	credit = READ_ONCE(node->credit);
+	if ( credit ) {
+		return credit;
+	}
+
+	if ( READ_ONCE(max_bandwidth_mbps) ) {
+		total_credit = archmon_mbps_to_credit(READ_ONCE(max_bandwidth_mbps), us);
+	}
+
+	return div64_u64(total_credit * atomic_read(&node->nr_cpus), max(atomic_read(&g_archmon_info.nr_cpus), 1));
+}
+
+static int archmon_node_credit_get(void* data, u64* val)
+{
+	struct archmon_node* node = data;
+
+	*val = node->credit;
+	return 0;
+}
+
+static int archmon_node_credit_set(void* data, u64 val)
+{
+	struct archmon_node* node = data;
+
+	WRITE_ONCE(node->credit, val);
+	archmon_config_changed();
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(node_credit_fops, archmon_node_credit_get, archmon_node_credit_set, "%llu\n");
+
+/*
+ *	Reads give the effective budget of the node, writes set it in MB/s
+ */
+static int archmon_node_mbps_get(void* data, u64* val)
+{
+	struct archmon_node* node = data;
+	u64 us = READ_ONCE(period_us);
+
+	*val = archmon_credit_to_mbps(archmon_node_credit(node, us), us);
+	return 0;
+}
+
+static int archmon_node_mbps_set(void* data, u64 val)
+{
+	struct archmon_node* node = data;
+
+	WRITE_ONCE(node->mbps, val);
+	archmon_config_changed();
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(node_mbps_fops, archmon_node_mbps_get, archmon_node_mbps_set, "%llu\n");
+
+static int archmon_credit_override_get(void* data, u64* val)
+{
+	struct pcpu_shared_resources_info* resource_info = data;
+
+	*val = resource_info->credit_override;
+	return 0;
+}
+
+static int archmon_credit_override_set(void* data, u64 val)
+{
+	struct pcpu_shared_resources_info* resource_info = data;
+
+	WRITE_ONCE(resource_info->credit_override, val);
+	archmon_config_changed();
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(credit_override_fops, archmon_credit_override_get, archmon_credit_override_set, "%llu\n");
+
+/*
+ *	Reads give the effective budget of the CPU, writes set it in MB/s
+ */
+static int archmon_mbps_get(void* data, u64* val)
+{
+	struct pcpu_shared_resources_info* resource_info = data;
+
+	*val = archmon_credit_to_mbps(READ_ONCE(resource_info->credit_per_period), ktime_to_us(resource_info->period));
+	return 0;
+}
+
+static int archmon_mbps_set(void* data, u64 val)
+{
+	struct pcpu_shared_resources_info* resource_info = data;
+
+	WRITE_ONCE(resource_info->mbps_override, val);
+	archmon_config_changed();
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(mbps_fops, archmon_mbps_get, archmon_mbps_set, "%llu\n");
+
+static int archmon_bw_reserve_get(void* data, u64* val)
+{
+	struct pcpu_shared_resources_info* resource_info = data;
+
+	*val = resource_info->bw_reserve;
+	return 0;
+}
+
+/*
+ *	Reservations are admitted only while they all fit in the node's credit
+ */
+static int archmon_bw_reserve_set(void* data, u64 val)
+{
+	struct pcpu_shared_resources_info* resource_info = data;
+	struct archmon_node* node = resource_info->node;
+	u64 total_reserve;
+	int ret = 0;
+
+	mutex_lock(&g_archmon_info.reserve_lock);
+
+	total_reserve = node->total_reserve - resource_info->bw_reserve + val;
+	if ( total_reserve > archmon_node_credit(node, READ_ONCE(period_us)) ) {
+		ret = -ENOSPC;
+	} else {
+		WRITE_ONCE(node->total_reserve, total_reserve);
+		WRITE_ONCE(resource_info->bw_reserve, val);
+		archmon_config_changed();
+	}
+
+	mutex_unlock(&g_archmon_info.reserve_lock);
+	return ret;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(bw_reserve_fops, archmon_bw_reserve_get, archmon_bw_reserve_set, "%llu\n");
+
+/*
+ *	Count a CPU's reservation in or out of the total, on hotplug
+ */
+static void archmon_account_reserve(struct pcpu_shared_resources_info* resource_info, bool online)
+{
+	struct archmon_node* node = resource_info->node;
+
+	if ( !resource_info->bw_reserve ) {
+		return;
+	}
+
+	mutex_lock(&g_archmon_info.reserve_lock);
+	if ( online ) {
+		WRITE_ONCE(node->total_reserve, node->total_reserve + resource_info->bw_reserve);
+	} else {
+		WRITE_ONCE(node->total_reserve, node->total_reserve - resource_info->bw_reserve);
+	}
+	mutex_unlock(&g_archmon_info.reserve_lock);
+}
+
+/*
+ *	Credit granted every period. Reservations are served first, then every
+ *	CPU of the node, reserved or not, gets an equal share of what is left,
+ *	so that a reservation is a floor rather than a cap. Beyond that, credit
+ *	is only shared through the node's reclaim pool, up to each CPU's limit.
+ */
+static u64 archmon_credit_per_cpu(struct pcpu_shared_resources_info* resource_info)
+{
+	struct archmon_node* node = resource_info->node;
+	u64 us = ktime_to_us(resource_info->period);
+	u64 credit = READ_ONCE(resource_info->mbps_override);
+	u64 node_credit, total_reserve;
+
+	if ( credit ) {
+		return archmon_mbps_to_credit(credit, us);
+	}
+
+	credit = READ_ONCE(resource_info->credit_override);
+	if ( credit ) {
+		return credit;
+	}
+
+	node_credit = archmon_node_credit(node, us);
+	total_reserve = READ_ONCE(node->total_reserve);
+	credit = div64_u64(node_credit > total_reserve ? node_credit - total_reserve : 0, 
+			max(atomic_read(&node->nr_cpus), 1));
+
+	return READ_ONCE(resource_info->bw_reserve) + credit;
+}
+
+/*
+ *	Pick up the current tunables, called at a period boundary
+ */
+static void archmon_apply_config(struct pcpu_shared_resources_info* resource_info)
+{
+	resource_info->config_gen = atomic_read(&g_archmon_info.config_gen);
+	smp_rmb();
+
+	resource_info->period = ns_to_ktime((u64)READ_ONCE(period_us) * NSEC_PER_USEC);
+	resource_info->credit_per_period = archmon_credit_per_cpu(resource_info);
+}
+
+/*
+ *	Periods of all CPUs are aligned to multiples of the period, so every CPU
+ *	crosses a boundary at the same clock value
+ */
+static ktime_t archmon_next_boundary(ktime_t period)
+{
+	u64 now = ktime_to_ns(ktime_get());
+	u64 interval = ktime_to_ns(period);
+
+	return ns_to_ktime((div64_u64(now, interval) + 1) * interval);
+}
+
+/*
+ *	Returns the boundary (ns) claimed last on exactly one CPU per period
+ *	boundary: the first one crossing it, -1 on the others. Boundaries are
+ *	multiples of the period on all CPUs.
+ */
+static s64 archmon_claim_boundary(atomic64_t* epoch, ktime_t boundary)
+{
+	s64 now = ktime_to_ns(boundary);
+	s64 old = atomic64_read(epoch);
+
+	return old < now && atomic64_cmpxchg(epoch, old, now) == old ? old : -1;
+}
+
+/*
+ *	Take up to 'chunk' credit out of a shared counter without locking
+ */
+static u64 archmon_take_credit(atomic64_t* pool, u64 chunk)
+{
+	s64 old, take;
+
+	do {
+		old = atomic64_read(pool);
+		take = min_t(s64, old, chunk);
+		if ( take <= 0 ) {
+			return 0;
+		}
+	} while ( atomic64_cmpxchg(pool, old, old - take) != old );
+
+	return take;
+}
+
+/*
+ *	Put unused credit into the node's pool. The pool is emptied once per
+ *	period by the first CPU of the node crossing the boundary, so donated
+ *	credit cannot pile up across periods. Credit never crosses nodes: each
+ *	node has its own memory controllers.
+ */
+static void archmon_donate_credit(struct archmon_node* node, ktime_t boundary, u64 credit)
+{
+	if ( archmon_claim_boundary(&node->credit_pool_epoch, boundary) >= 0 ) {
+		atomic64_set(&node->credit_pool, 0);
+	}
+
+	if ( credit ) {
+		atomic64_add(credit, &node->credit_pool);
+	}
+}
+
+static u64 archmon_borrow_credit(struct archmon_node* node, u64 chunk)
+{
+	return archmon_take_credit(&node->credit_pool, chunk);
+}
+
+/*
+ *	Group of a task, NULL if its cgroup has no budget. Caller holds RCU.
+ */
+static struct archmon_group* archmon_group_of(struct task_struct* task)
+{
+	struct cgroup* cgrp = task_dfl_cgroup(task);
+	struct archmon_group* group;
+
+	hlist_for_each_entry_rcu(group, &g_archmon_info.group_hash[hash_ptr(cgrp, ARCHMON_GROUP_HASH_BITS)], hash_node) {
+		if ( group->cgrp == cgrp ) {
+			return group;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *	Charge misses to the running task's group, returns true if the group is
+ *	out of credit. O(1): credit is pulled from the group in chunks and cached
+ *	per CPU.
+ */
+static bool archmon_group_charge(struct pcpu_shared_resources_info* resource_info, u64 misses)
+{
+	struct archmon_group* group;
+	struct pcpu_group_info* group_info;
+	bool over_budget = false;
+
+	rcu_read_lock();
+
+	group = archmon_group_of(current);
+	if ( !group ) {
+		goto out;
+	}
+
+	group_info = &resource_info->groups[group->slot];
+	group_info->used += misses;
+
+	if ( group_info->credit < misses ) {
+		group_info->credit += archmon_take_credit(&group->remaining, 
+				max(misses - group_info->credit, READ_ONCE(group->budget) >> GROUP_CHUNK_SHIFT));
+	}
+
+	if ( group_info->credit >= misses ) {
+		group_info->credit -= misses;
+	} else {
+		group_info->credit = 0;
+		over_budget = true;
+	}
+
+out:
+	rcu_read_unlock();
+	return over_budget;
+}
+
+/*
+ *	Refill a group for the periods elapsed since the last refill (more than
+ *	one when every CPU runs an adaptive window); in token bucket mode what
+ *	is left carries over. Budgets in MB/s are converted with the period
+ *	being started.
+ */
+static void archmon_group_refill(struct archmon_group* group, ktime_t period, u64 periods)
+{
+	u64 mbps = READ_ONCE(group->mbps);
+	u64 budget, depth;
+	s64 old, new;
+
+	if ( mbps ) {
+		WRITE_ONCE(group->budget, archmon_mbps_to_credit(mbps, ktime_to_us(period)));
+	}
+
+	budget = READ_ONCE(group->budget) * periods;
+	depth = archmon_bucket_depth(READ_ONCE(group->depth), READ_ONCE(group->budget), READ_ONCE(burst_periods));
+
+	if ( !token_bucket ) {
+		atomic64_set(&group->remaining, budget);
+		return;
+	}
+
+	do {
+		old = atomic64_read(&group->remaining);
+		new = min_t(u64, max_t(s64, old, 0) + budget, max(depth, budget));
+	} while ( atomic64_cmpxchg(&group->remaining, old, new) != old );
+}
+
+/*
+ *	Fold this CPU's group counters at a period boundary; the first CPU
+ *	crossing the boundary also refills every group
+ */
+static void archmon_group_period(struct pcpu_shared_resources_info* resource_info, ktime_t boundary)
+{
+	struct archmon_group* group;
+	s64 last = archmon_claim_boundary(&g_archmon_info.group_epoch, boundary);
+	bool refill = last >= 0;
+	u64 periods = 1;
+
+	if ( last > 0 ) {
+		periods = clamp_t(u64, div64_u64(ktime_to_ns(boundary) - last, ktime_to_ns(resource_info->period)), 
+				1, 1 << ADAPT_MAX_SHIFT);
+	}
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(group, &g_archmon_info.group_list, list) {
+		struct pcpu_group_info* group_info = &resource_info->groups[group->slot];
+
+		if ( refill ) {
+			archmon_group_refill(group, resource_info->period, periods);
+		}
+
+		if ( group_info->used ) {
+			atomic64_add(group_info->used, &group->usage);
+			group_info->used = 0;
+		}
+		group_info->credit = 0;
+	}
+	rcu_read_unlock();
+}
+
+/*
+ *	Program the next overflow, once the credit could be used up. With
+ *	groups, the counters also overflow every quantum so that misses get
+ *	charged to the group that is running.
+ */
+static void archmon_set_sample_period(struct pcpu_shared_resources_info* resource_info, u64 credit)
+{
+	if ( READ_ONCE(g_archmon_info.nr_groups) ) {
+		credit = min(credit, resource_info->credit_per_period >> GROUP_QUANTUM_SHIFT);
+	}
+
+	g_archmon_info.backend->set_period(resource_info, credit);
+}
+
+static void archmon_stop_events(struct pcpu_shared_resources_info* resource_info)
+{
+	g_archmon_info.backend->stop(resource_info);
+}
+
+static void archmon_start_events(struct pcpu_shared_resources_info* resource_info)
+{
+	g_archmon_info.backend->start(resource_info);
+}
+
+static u64 archmon_read_traffic(struct pcpu_shared_resources_info* resource_info, bool live)
+{
+	return g_archmon_info.backend->read(resource_info, live);
+}
+
+static u64 archmon_read_fills(struct pcpu_shared_resources_info* resource_info)
+{
+	return g_archmon_info.backend->read_fills(resource_info);
+}
+
+/*
+ *	Credit a CPU may get on top of its grant at a time: none while it is
+ *	over its cache limit, never past its bandwidth limit
+ */
+static u64 archmon_extra_chunk(struct pcpu_shared_resources_info* resource_info)
+{
+	return archmon_reclaim_chunk(resource_info->credit_per_period, resource_info->period_credit, 
+			resource_info->cache_scale, READ_ONCE(resource_info->bw_limit) << resource_info->period_shift);
+}
+
+/*
+ *	Extend this period's credit instead of throttling
+ */
+static void archmon_extend_credit(struct pcpu_shared_resources_info* resource_info, u64 credit)
+{
+	archmon_stop_events(resource_info);
+	resource_info->credit = credit;
+	resource_info->credit_base = archmon_read_traffic(resource_info, false);
+	resource_info->period_credit += credit;
+	archmon_set_sample_period(resource_info, credit);
+	archmon_start_events(resource_info);
+}
+
+/*
+ *	The CPU reading the uncore IMC events of its socket. Uncore events live
+ *	on one CPU per socket, perf moves them on hotplug.
+ */
+static bool archmon_imc_reader(struct pcpu_shared_resources_info* resource_info)
+{
+	struct archmon_package* package = resource_info->package;
+
+	return package && package->nr_imc_events && READ_ONCE(package->imc_events[0]->cpu) == smp_processor_id();
+}
+
+/*
+ *	Let the CPU go on for another chunk while its socket's memory
+ *	controllers are below saturation. Without a recent IMC sample, the
+ *	per-core budget applies as before.
+ */
+static bool archmon_dram_credit(struct pcpu_shared_resources_info* resource_info)
+{
+	struct archmon_package* package = resource_info->package;
+	unsigned int saturation = READ_ONCE(imc_saturation_mbps);
+	u64 stamp, chunk;
+
+	if ( !saturation || !package || !package->nr_imc_events ) {
+		return false;
+	}
+
+	stamp = READ_ONCE(package->imc_stamp);
+	if ( !stamp ) {
+		return false;
+	}
+
+	/* The reader missed a period, e.g. on its way offline */
+	if ( ktime_get_ns() - stamp > 2 * ktime_to_ns(resource_info->period) ) {
+		return false;
+	}
+
+	if ( READ_ONCE(package->dram_mbps) >= saturation ) {
+		return false;
+	}
+
+	chunk = archmon_extra_chunk(resource_info);
+	if ( !chunk ) {
+		return false;
+	}
+
+	archmon_extend_credit(resource_info, chunk);
+	return true;
+}
+
+/*
+ *	Extend this period's credit from the pool instead of throttling
+ */
+static bool archmon_reclaim_credit(struct pcpu_shared_resources_info* resource_info)
+{
+	u64 chunk = archmon_extra_chunk(resource_info);
+	u64 credit = chunk ? archmon_borrow_credit(resource_info->node, chunk) : 0;
+
+	if ( !credit ) {
+		return false;
+	}
+
+	archmon_extend_credit(resource_info, credit);
+
+#if AHN_DEBUG
+	printk("[%d] reclaimed %llu credit\n", smp_processor_id(), credit);
+#endif
+	return true;
+}
+
+/*
+ *	Only updated by its own CPU, but from the throttle thread, the irq_work
+ *	and the overflow handler (NMI) alike: local64 increments cannot be torn
+ *	by an interrupt and need no lock prefix.
+ */
+static void archmon_hist_add(int type, u64 ns)
+{
+	struct archmon_hists* hists = this_cpu_ptr(g_archmon_info.hists);
+	int bucket = min(fls64(ns | 1), ARCHMON_HIST_BUCKETS) - 1;
+
+	local64_inc(&hists->count[type][bucket]);
+}
+
+static bool archmon_is_throttled(struct pcpu_shared_resources_info* resource_info)
+{
+	return resource_info->throttled || !list_empty(&resource_info->throttled_tasks);
+}
+
+/*
+ *	Exempt tasks are charged like any other, but never stopped: the
+ *	best-effort tasks of the CPU or group absorb the throttling
+ */
+static bool archmon_is_exempt(struct task_struct* task)
+{
+	struct archmon_exempt* exempt;
+	struct cgroup* cgrp;
+	bool ret = false;
+	int i;
+
+	if ( READ_ONCE(exempt_rt) && rt_task(task) ) {
+		return true;
+	}
+
+	if ( task_nice(task) <= READ_ONCE(exempt_nice) ) {
+		return true;
+	}
+
+	if ( !READ_ONCE(g_archmon_info.nr_exempt) ) {
+		return false;
+	}
+
+	rcu_read_lock();
+	cgrp = task_dfl_cgroup(task);
+	for ( i = 0; i < ARCHMON_MAX_EXEMPT && !ret; i++ ) {
+		exempt = rcu_dereference(g_archmon_info.exempt[i]);
+		ret = exempt && cgroup_is_descendant(cgrp, exempt->cgrp);
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/*
+ *	Whether any task may be exempt at all
+ */
+static bool archmon_exempt_configured(void)
+{
+	return READ_ONCE(exempt_rt) || READ_ONCE(exempt_nice) >= MIN_NICE || READ_ONCE(g_archmon_info.nr_exempt);
+}
+
+/*
+ *	Stop a task until the period boundary. The set keeps a reference on the
+ *	pid, so the task may exit or migrate meanwhile. Since all CPUs share the
+ *	same boundaries, it does not matter which CPU's timer resumes it.
+ */
+static void archmon_throttle_task(struct pcpu_shared_resources_info* resource_info, struct task_struct* task, bool group)
+{
+	struct archmon_throttled_task* throttled;
+	struct pid* pid = task_pid(task);
+
+	/* Kernel threads (including the throttle thread) cannot be stopped */
+	if ( (task->flags & PF_KTHREAD) || archmon_is_exempt(task) ) {
+		return;
+	}
+
+	/* Once the CPU is out of credit too, the task waits for the CPU's boundary */
+	list_for_each_entry(throttled, &resource_info->throttled_tasks, list) {
+		if ( throttled->pid == pid ) {
+			throttled->group &= group;
+			return;
+		}
+	}
+
+	throttled = kmalloc(sizeof(*throttled), GFP_ATOMIC);
+	if ( !throttled ) {
+		return;
+	}
+
+	if ( !archmon_is_throttled(resource_info) ) {
+		resource_info->throttle_start = ktime_get_ns();
+	}
+
+	throttled->pid = get_pid(pid);
+	throttled->group = group;
+	list_add_tail(&throttled->list, &resource_info->throttled_tasks);
+	resource_info->throttled_pid = pid_nr(pid);
+
+	kill_pid(pid, SIGSTOP, 1);
+	trace_archmon_throttle_task(smp_processor_id(), pid_nr(pid));
+#if AHN_DEBUG
+	printk("[%d] a process %d needs to be throttled down \n", smp_processor_id(), pid_nr(pid));
+#endif
+}
+
+/*
+ *	Take the CPU away for the rest of the period, whichever task runs on it
+ */
+static void archmon_throttle(struct pcpu_shared_resources_info* resource_info, int mode)
+{
+	/*
+	 * The throttle thread would take the CPU away from exempt tasks as
+	 * well, not just from the one running now: only stop the tasks that
+	 * are not exempt
+	 */
+	if ( mode == ARCHMON_THROTTLE_KTHREAD && archmon_exempt_configured() ) {
+		mode = ARCHMON_THROTTLE_SIGNAL;
+	}
+
+	if ( !archmon_is_throttled(resource_info) ) {
+		resource_info->throttle_start = ktime_get_ns();
+	}
+
+	resource_info->throttle_mode = mode;
+	resource_info->throttled = true;
+
+	/* Reading the counters is not free, only do it when tracing */
+	if ( trace_archmon_throttle_enabled() ) {
+		trace_archmon_throttle(smp_processor_id(), task_pid_nr(current), mode, 
+				archmon_read_traffic(resource_info, true) - resource_info->period_base, resource_info->period_credit);
+	}
+
+	if ( resource_info->throttle_mode == ARCHMON_THROTTLE_KTHREAD ) {
+		resource_info->throttled_pid = task_pid_nr(current);
+		wake_up_interruptible(&resource_info->throttle_evt);
+		return;
+	}
+
+	/* 
+	 * Stop the running task, and sample finely from now on so that any
+	 * other task missing in the LLC this period gets stopped as well
+	 */
+	archmon_throttle_task(resource_info, current, false);
+	archmon_hist_add(ARCHMON_HIST_STOP, local_clock() - resource_info->exhausted_at);
+
+	archmon_stop_events(resource_info);
+	archmon_set_sample_period(resource_info, max_t(u64, resource_info->credit_per_period >> THROTTLE_SAMPLE_SHIFT, 
+				THROTTLE_SAMPLE_MIN));
+	archmon_start_events(resource_info);
+}
+
+/*
+ *	Resume the stopped tasks, or only those stopped for their group
+ */
+static int archmon_resume_tasks(struct pcpu_shared_resources_info* resource_info, bool group_only)
+{
+	struct archmon_throttled_task *throttled, *tmp;
+	int nr_tasks = 0;
+
+	list_for_each_entry_safe(throttled, tmp, &resource_info->throttled_tasks, list) {
+		if ( group_only && !throttled->group ) {
+			continue;
+		}
+#if AHN_DEBUG
+		printk("[%d] a process %d needs to be throttled up \n", smp_processor_id(), pid_nr(throttled->pid));
+#endif
+		kill_pid(throttled->pid, SIGCONT, 1);
+		put_pid(throttled->pid);
+		list_del(&throttled->list);
+		kfree(throttled);
+		nr_tasks++;
+	}
+
+	return nr_tasks;
+}
+
+/*
+ *	Give the CPU back at the period boundary
+ */
+static void archmon_unthrottle(struct pcpu_shared_resources_info* resource_info)
+{
+	int nr_tasks;
+
+	archmon_hist_add(ARCHMON_HIST_THROTTLE, ktime_get_ns() - resource_info->throttle_start);
+
+	/* The throttle thread is spinning on this flag */
+	WRITE_ONCE(resource_info->throttled, false);
+
+	nr_tasks = archmon_resume_tasks(resource_info, false);
+	trace_archmon_unthrottle(smp_processor_id(), nr_tasks, resource_info->throttle_start);
+}
+
+/*
+ *	The groups were refilled: their tasks may run again, even though this
+ *	CPU's own window goes on
+ */
+static void archmon_group_unthrottle(struct pcpu_shared_resources_info* resource_info)
+{
+	int nr_tasks = archmon_resume_tasks(resource_info, true);
+
+	if ( !nr_tasks ) {
+		return;
+	}
+
+	if ( !archmon_is_throttled(resource_info) ) {
+		archmon_hist_add(ARCHMON_HIST_THROTTLE, ktime_get_ns() - resource_info->throttle_start);
+	}
+	trace_archmon_unthrottle(smp_processor_id(), nr_tasks, resource_info->throttle_start);
+}
+
+/*
+ *	Per-CPU throttle thread
+ *
+ *	Sleeps until the CPU runs out of credit, then keeps the CPU busy in the
+ *	kernel (not counted by the miss event) until the period timer clears
+ *	the throttled flag. It runs as SCHED_FIFO so it preempts the over-budget
+ *	task right away, but below the top RT priorities so that critical RT
+ *	threads are not starved. A window can last seconds, so it also gives
+ *	the scheduler a chance on non-preemptible kernels (RCU, the stopper).
+ */
+static int archmon_throttle_thread(void* arg)
+{
+	struct pcpu_shared_resources_info* resource_info = arg;
+
+	/* Middle of the RT range, what in-kernel FIFO users are meant to get */
+	sched_set_fifo(current);
+
+	while ( !kthread_should_stop() ) {
+
+		wait_event_interruptible(resource_info->throttle_evt,
+				READ_ONCE(resource_info->throttled) || kthread_should_stop());
+
+		/* The over-budget task is off the CPU from now on */
+		if ( READ_ONCE(resource_info->throttled) ) {
+			archmon_hist_add(ARCHMON_HIST_STOP, local_clock() - resource_info->exhausted_at);
+		}
+
+		while ( READ_ONCE(resource_info->throttled) && !kthread_should_stop() ) {
+			cond_resched();
+			cpu_relax();
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	An idle CPU saw traffic again: start a new period right away, and the
+ *	timer with it
+ */
+static void archmon_wake(struct pcpu_shared_resources_info* resource_info)
+{
+	ktime_t boundary;
+	u64 count;
+
+	/* Going offline */
+	if ( !resource_info->counting ) {
+		return;
+	}
+
+	/* Tunables changed while the CPU was idle, the period may have too */
+	if ( resource_info->config_gen != atomic_read(&g_archmon_info.config_gen) ) {
+		archmon_apply_config(resource_info);
+	}
+	boundary = archmon_next_boundary(resource_info->period);
+
+	archmon_stop_events(resource_info);
+	count = archmon_read_traffic(resource_info, false);
+
+	resource_info->idle = false;
+	resource_info->period_shift = 0;
+	resource_info->period_start = ktime_sub(boundary, resource_info->period);
+	resource_info->period_end = boundary;
+	resource_info->nr_slices = 1;
+	resource_info->slice = 0;
+
+	resource_info->credit = resource_info->credit_per_period;
+	resource_info->credit_base = count;
+	resource_info->period_base = count;
+	resource_info->period_credit = resource_info->credit;
+	resource_info->period_grant = resource_info->credit;
+
+	archmon_set_sample_period(resource_info, resource_info->credit);
+	archmon_start_events(resource_info);
+
+	hrtimer_start(&resource_info->period_timer, boundary, HRTIMER_MODE_ABS_PINNED);
+}
+
+/*
+ *	One of several events used up its share of the credit: share out what
+ *	is left
+ */
+static void archmon_reprogram(struct pcpu_shared_resources_info* resource_info)
+{
+	u64 used_credit;
+
+	archmon_stop_events(resource_info);
+	used_credit = archmon_read_traffic(resource_info, false) - resource_info->credit_base;
+	archmon_set_sample_period(resource_info, resource_info->credit > used_credit ? resource_info->credit - used_credit : 0);
+	archmon_start_events(resource_info);
+}
+
+/*
+ *	Deferred part of the overflow: runs in IRQ context right after the PMI
+ */
+static void archmon_throttle_work(struct irq_work* work)
+{
+	struct pcpu_shared_resources_info* resource_info = container_of(work, struct pcpu_shared_resources_info, throttle_work);
+	bool cpu_throttle = false, group_throttle = false;
+
+	if ( resource_info->wake_pending ) {
+		resource_info->wake_pending = false;
+		archmon_wake(resource_info);
+		return;
+	}
+
+	/* Throttling reprograms the events anyway */
+	if ( resource_info->reprogram_pending ) {
+		resource_info->reprogram_pending = false;
+		if ( !resource_info->overflow_pending && !resource_info->throttled ) {
+			archmon_reprogram(resource_info);
+		}
+	}
+
+	/* The period timer may have refilled the credit in the meantime */
+	if ( resource_info->overflow_pending ) {
+		resource_info->overflow_pending = false;
+		cpu_throttle = resource_info->throttled || 
+			!((reclaim && archmon_reclaim_credit(resource_info)) || archmon_dram_credit(resource_info));
+	}
+
+	if ( resource_info->group_pending ) {
+		resource_info->group_pending = false;
+		group_throttle = true;
+	}
+
+	if ( !cpu_throttle && !group_throttle ) {
+		return;
+	}
+
+	/* need to throttle process running on the cpu */
+	if ( cpu_throttle ) {
+		if ( !resource_info->throttled ) {
+			archmon_throttle(resource_info, throttle_mode);
+		} else if ( resource_info->throttle_mode == ARCHMON_THROTTLE_SIGNAL ) {
+			/* Another task got the CPU while it is throttled */
+			archmon_throttle_task(resource_info, current, false);
+		}
+	}
+
+	/* An over-budget group only loses its own task, never the whole CPU */
+	if ( group_throttle ) {
+		struct archmon_group* group;
+
+		archmon_throttle_task(resource_info, current, true);
+
+		rcu_read_lock();
+		group = archmon_group_of(current);
+		if ( group ) {
+			atomic64_inc(&group->throttle_count);
+		}
+		rcu_read_unlock();
+	}
+}
+
+/*
+ *	Counter overflow, 'charged' counted since the last one
+ *
+ *	May run in NMI context, so only record the event and defer the rest.
+ */
+static void archmon_overflow(struct pcpu_shared_resources_info* resource_info, u64 charged)
+{
+	u64 start = local_clock();
+	u64 used_credit = archmon_read_traffic(resource_info, true) - resource_info->credit_base;
+	u64 delta;
+
+	trace_archmon_overflow(smp_processor_id(), task_pid_nr(current), used_credit, resource_info->credit);
+
+	if ( READ_ONCE(g_archmon_info.nr_groups) && archmon_group_charge(resource_info, charged) ) {
+		if ( !resource_info->group_pending ) {
+			resource_info->group_pending = true;
+			irq_work_queue(&resource_info->throttle_work);
+		}
+	}
+
+	/* The timer is stopped, have it restarted */
+	if ( resource_info->idle ) {
+		if ( !resource_info->wake_pending ) {
+			resource_info->wake_pending = true;
+			irq_work_queue(&resource_info->throttle_work);
+		}
+		goto out;
+	}
+
+	/* Nothing is throttled while the peak is measured */
+	if ( READ_ONCE(g_archmon_info.calibrating) ) {
+		goto out;
+	}
+
+	if ( !archmon_credit_exhausted(used_credit, resource_info->credit) ) {
+		if ( resource_info->nr_perf_events > 1 && !resource_info->reprogram_pending ) {
+			resource_info->reprogram_pending = true;
+			irq_work_queue(&resource_info->throttle_work);
+		}
+		goto out;
+	}
+	
+	/* End up its credit! */
+	resource_info->credit = 0;
+	resource_info->exhausted_at = start;
+
+	/* In kthread mode nobody else can run until the boundary */
+	if ( !(resource_info->throttled && resource_info->throttle_mode == ARCHMON_THROTTLE_KTHREAD) && 
+			!resource_info->overflow_pending ) {
+		resource_info->overflow_pending = true;
+		irq_work_queue(&resource_info->throttle_work);
+	}
+
+out:
+	delta = local_clock() - start;
+	resource_info->overflow_count++;
+	resource_info->overflow_ns += delta;
+	if ( delta > resource_info->overflow_max_ns ) {
+		resource_info->overflow_max_ns = delta;
+	}
+	archmon_hist_add(ARCHMON_HIST_OVERFLOW, delta);
+}
+
+static unsigned int archmon_event_weight(struct pcpu_shared_resources_info* resource_info, struct perf_event* event)
+{
+	int i;
+
+	for ( i = 0; i < resource_info->nr_perf_events; i++ ) {
+		if ( resource_info->perf_events[i] == event ) {
+			return resource_info->event_weights[i];
+		}
+	}
+
+	return 1;
+}
+
+/*
+ *	L3 cache miss overflow callback
+ */
+static void perf_l3c_miss_overflow(struct perf_event* event, struct perf_sample_data* data, struct pt_regs* regs)
+{
+	struct pcpu_shared_resources_info* resource_info = this_cpu_ptr(g_archmon_info.pcpu_resources_info);
+
+	archmon_overflow(resource_info, event->hw.last_period * archmon_event_weight(resource_info, event));
+}
+
+/*
+ *	Create a performance counter (reference 'arch/x86/kvm/pmu.c')
+ */
+static struct perf_event* reprogram_counter(int cpu, u32 type, u64 config, 
+		bool exclude_user, bool exclude_kernel, u64 period,  perf_overflow_handler_t callback)
+{
+	struct perf_event *event = NULL;
+	struct perf_event_attr attr = {
+		.type = type,
+		.config	= config,
+		.size = sizeof(struct perf_event_attr),
+		.exclude_user = exclude_user,
+		.exclude_kernel = exclude_kernel,
+		.pinned = true,
+		.sample_period = period,
+	};
+
+	event = perf_event_create_kernel_counter(&attr, cpu, NULL, callback, NULL);
+
+	if ( IS_ERR(event) ) {
+		printk(KERN_ERR "pmu event creation failed %ld\n", PTR_ERR(event));
+		return NULL;
+	}
+	
+	return event;
+}
+
+/*
+ * Release a performance counter
+ */
+static void stop_counter(struct perf_event* event)
+{
+	if ( event ) {
+		perf_event_release_kernel(event);
+	}
+}
+
+
+/*
+ *	Append the record of the period that just ended, begun at 'start', to
+ *	this CPU's ring
+ */
+static void archmon_telemetry_record(struct pcpu_shared_resources_info* resource_info, ktime_t start, 
+		u64 used, u64 throttle_ns)
+{
+	struct archmon_ring* ring = resource_info->ring;
+	struct archmon_record* record;
+	u64 head = ring->head;
+	u64 tail = smp_load_acquire(&ring->tail);
+
+	if ( head - tail >= ARCHMON_RING_SIZE ) {
+		WRITE_ONCE(ring->lost, ring->lost + 1);
+		return;
+	}
+
+	record = &ring->records[head & (ARCHMON_RING_SIZE - 1)];
+	record->timestamp = ktime_to_ns(start);
+	record->used = used;
+	record->credit = resource_info->period_credit;
+	record->throttle_ns = throttle_ns;
+	record->throttled_pid = throttle_ns ? resource_info->throttled_pid : 0;
+
+	/* Publish the record before the new head */
+	smp_store_release(&ring->head, head + 1);
+
+	if ( head + 1 - tail >= READ_ONCE(telemetry_watermark) && wq_has_sleeper(&g_archmon_info.telemetry_wq) ) {
+		wake_up_interruptible(&g_archmon_info.telemetry_wq);
+	}
+}
+
+/*
+ *	Estimate this CPU's LLC occupancy at a period boundary and derive the
+ *	miss budget scale from it. Every line filled into the LLC evicts a
+ *	line, which belongs to this CPU with probability occupancy / LLC size:
+ *
+ *		occupancy += own fills - all fills * occupancy / LLC size
+ *
+ *	Fills of the other CPUs are those of the previous boundaries.
+ *	Userspace may feed a measured occupancy (resctrl/CMT) to correct it.
+ */
+static void archmon_cache_period(struct pcpu_shared_resources_info* resource_info, u64 fills)
+{
+	struct archmon_llc* llc = &g_archmon_info.llcs[resource_info->llc_id];
+	u64 size = g_archmon_info.llc_size;
+	u64 fill_bytes = fills * cache_line_size();
+	u64 all_fills, total, evicted, occupancy, measured, limit, reserve;
+	unsigned int scale = 1U << CACHE_SCALE_SHIFT;
+	bool unmet;
+
+	total = atomic64_add_return(fill_bytes, &llc->fills);
+	all_fills = total - resource_info->llc_fills_seen;
+	resource_info->llc_fills_seen = total;
+
+	measured = xchg(&resource_info->llc_measured, 0);
+	if ( measured ) {
+		occupancy = min(measured, size);
+	} else {
+		occupancy = resource_info->llc_occupancy;
+		evicted = all_fills >= size ? occupancy : div64_u64(occupancy * all_fills, size);
+		occupancy = min(occupancy - evicted + fill_bytes, size);
+	}
+	resource_info->llc_occupancy = occupancy;
+
+	reserve = READ_ONCE(resource_info->cache_reserve) * 1024;
+	limit = READ_ONCE(resource_info->cache_limit) * 1024;
+
+	unmet = reserve && occupancy < reserve;
+	if ( unmet != resource_info->cache_unmet ) {
+		atomic_add(unmet ? 1 : -1, &llc->cache_unmet);
+		resource_info->cache_unmet = unmet;
+	}
+
+	/* Make room for reservations still warming up: no more than a fair share */
+	if ( !reserve && atomic_read(&llc->cache_unmet) ) {
+		u64 share = div64_u64(size, max(atomic_read(&llc->nr_cpus), 1));
+
+		limit = limit ? min(limit, share) : share;
+	}
+
+	/* Shrink the miss budget in proportion to the excess */
+	if ( limit && occupancy > limit ) {
+		scale = max_t(u64, div64_u64(limit << CACHE_SCALE_SHIFT, occupancy), 1U << (CACHE_SCALE_SHIFT - CACHE_SCALE_MIN_SHIFT));
+	}
+	resource_info->cache_scale = scale;
+}
+
+/*
+ *	Slices per period, each slice no shorter than MIN_INTERVAL_US
+ */
+static int archmon_nr_slices(ktime_t period)
+{
+	unsigned int nr_slices = clamp_t(unsigned int, READ_ONCE(pacing_slices), 1, ARCHMON_MAX_SLICES);
+
+	return min_t(u64, nr_slices, max_t(u64, div_u64(ktime_to_us(period), MIN_INTERVAL_US), 1));
+}
+
+static ktime_t archmon_slice_boundary(struct pcpu_shared_resources_info* resource_info, int slice)
+{
+	u64 length = ktime_to_ns(ktime_sub(resource_info->period_end, resource_info->period_start));
+
+	return ktime_add_ns(resource_info->period_start, div64_u64(length * slice, resource_info->nr_slices));
+}
+
+/*
+ *	Slice boundary (pacing mode). By the end of slice k, (k + 1) / N of the
+ *	period's credit may have been used. A CPU that ran out only waits for
+ *	the next slice, what a slice leaves unused goes to the next ones.
+ */
+static void do_archmon_slice_timer(struct pcpu_shared_resources_info* resource_info)
+{
+	u64 count, used_credit, allowance;
+
+	archmon_stop_events(resource_info);
+	count = archmon_read_traffic(resource_info, false);
+	used_credit = count - resource_info->period_base;
+
+	resource_info->slice++;
+
+	/* 
+	 * An adaptive window has slices on every period boundary: groups are
+	 * refilled there, not only at the end of the window
+	 */
+	if ( READ_ONCE(g_archmon_info.nr_groups) && 
+			resource_info->slice % (resource_info->nr_slices >> resource_info->period_shift) == 0 ) {
+		archmon_group_period(resource_info, archmon_slice_boundary(resource_info, resource_info->slice));
+		archmon_group_unthrottle(resource_info);
+	}
+
+	allowance = archmon_slice_allowance(resource_info->period_grant, resource_info->period_credit - resource_info->period_grant, 
+			resource_info->slice, resource_info->nr_slices);
+
+	/* Still ahead of the pace, a throttled CPU stays throttled */
+	if ( used_credit < allowance ) {
+		resource_info->credit = allowance - used_credit;
+		resource_info->credit_base = count;
+		resource_info->overflow_pending = false;
+
+		if ( archmon_is_throttled(resource_info) ) {
+			archmon_unthrottle(resource_info);
+		}
+
+		archmon_set_sample_period(resource_info, resource_info->credit);
+	}
+
+	archmon_start_events(resource_info);
+}
+
+/*
+ *	Adaptive period: the window doubles while the CPU uses less than a
+ *	quarter of its credit, and shrinks back as it gets close to its budget.
+ *	The credit scales with the window, so the bandwidth per second stays
+ *	the same. A CPU idle for a whole window of the largest size stops its
+ *	timer until the counters see traffic again.
+ */
+static void archmon_adapt_period(struct pcpu_shared_resources_info* resource_info, u64 used)
+{
+	u64 granted = resource_info->period_grant;
+
+	resource_info->idle = false;
+
+	/* The IMC reader samples its socket every period */
+	if ( !READ_ONCE(adaptive_period) || archmon_is_throttled(resource_info) || archmon_imc_reader(resource_info) || 
+			READ_ONCE(g_archmon_info.calibrating) ) {
+		resource_info->period_shift = 0;
+	} else {
+		resource_info->period_shift = archmon_adapt_shift(resource_info->period_shift, used, granted, &resource_info->idle);
+	}
+}
+
+/*
+ *	Calibration: the node's traffic is summed over each period, and the
+ *	first CPU crossing a boundary folds the sum of the last period into the
+ *	peak. Periods are fixed while calibrating, see archmon_adapt_period().
+ */
+static void archmon_calibrate_period(struct pcpu_shared_resources_info* resource_info, u64 used)
+{
+	struct archmon_node* node = resource_info->node;
+	u64 mbps;
+
+	if ( archmon_claim_boundary(&node->calibrate_epoch, resource_info->period_start) >= 0 ) {
+		mbps = archmon_credit_to_mbps(atomic64_xchg(&node->calibrate_sum, 0), ktime_to_us(resource_info->period));
+		if ( mbps > node->peak_mbps ) {
+			WRITE_ONCE(node->peak_mbps, mbps);
+		}
+	}
+
+	atomic64_add(used, &node->calibrate_sum);
+}
+
+/*
+ *	Sample the socket's DRAM bandwidth, on the CPU its IMC events live on
+ */
+static void archmon_imc_period(struct pcpu_shared_resources_info* resource_info)
+{
+	struct archmon_package* package = resource_info->package;
+	u64 count = 0, value, now;
+	int i;
+
+	if ( !archmon_imc_reader(resource_info) ) {
+		return;
+	}
+
+	for ( i = 0; i < package->nr_imc_events; i++ ) {
+		if ( perf_event_read_local(package->imc_events[i], &value, NULL, NULL) ) {
+			return;
+		}
+		count += value;
+	}
+
+	now = ktime_get_ns();
+	if ( package->imc_stamp ) {
+		WRITE_ONCE(package->dram_mbps, 
+				div64_u64((count - package->imc_count) * IMC_CAS_BYTES * 1000, now - package->imc_stamp));
+	}
+	package->imc_count = count;
+	WRITE_ONCE(package->imc_stamp, now);
+}
+
+/*
+ *	End of the window begun at 'start'
+ */
+static void do_archmon_period_timer(ktime_t start)
+{
+	int cpu_id;
+	struct pcpu_shared_resources_info* resource_info;
+	u64 count, used_credit, unused_credit, depth, fills;
+	u64 throttle_ns = 0;
+
+	cpu_id = smp_processor_id();
+
+#if AHN_DEBUG
+	printk("[%d] timer invoked!\n", smp_processor_id());
+#endif
+
+	resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, cpu_id);
+
+	/* Stop the perf events */
+	archmon_stop_events(resource_info);
+	count = archmon_read_traffic(resource_info, false);
+	used_credit = count - resource_info->credit_base;
+	unused_credit = resource_info->credit > used_credit ? resource_info->credit - used_credit : 0;
+
+	if ( archmon_is_throttled(resource_info) ) {
+		throttle_ns = ktime_get_ns() - resource_info->throttle_start;
+	}
+	archmon_telemetry_record(resource_info, start, count - resource_info->period_base, throttle_ns);
+
+	if ( READ_ONCE(g_archmon_info.calibrating) ) {
+		archmon_calibrate_period(resource_info, count - resource_info->period_base);
+	}
+
+	/* New tunables take effect with the new period */
+	if ( resource_info->config_gen != atomic_read(&g_archmon_info.config_gen) ) {
+		archmon_apply_config(resource_info);
+	}
+
+	if ( READ_ONCE(g_archmon_info.nr_groups) ) {
+		archmon_group_period(resource_info, resource_info->period_start);
+	}
+
+	fills = archmon_read_fills(resource_info);
+	archmon_cache_period(resource_info, fills - resource_info->fill_base);
+	resource_info->fill_base = fills;
+
+	archmon_imc_period(resource_info);
+	archmon_adapt_period(resource_info, count - resource_info->period_base);
+
+	/* Reset the credit, in token bucket mode unused credit carries over */
+	depth = token_bucket ? archmon_bucket_depth(READ_ONCE(resource_info->bucket_depth), 
+			resource_info->credit_per_period, READ_ONCE(burst_periods)) : 0;
+	resource_info->credit = archmon_refill_credit(resource_info->credit_per_period, resource_info->period_shift, 
+			resource_info->cache_scale, depth, READ_ONCE(resource_info->bw_limit), &unused_credit);
+
+	trace_archmon_refill(cpu_id, ktime_to_ns(resource_info->period_start), 
+			count - resource_info->period_base, unused_credit, resource_info->credit);
+
+	/* What does not fit in the bucket can still be used by others */
+	if ( reclaim ) {
+		archmon_donate_credit(resource_info->node, resource_info->period_start, unused_credit);
+	}
+
+	resource_info->credit_base = count;
+	resource_info->period_base = count;
+	resource_info->period_credit = resource_info->credit;
+	resource_info->period_grant = resource_info->credit;
+	resource_info->overflow_pending = false;
+	resource_info->group_pending = false;
+	resource_info->reprogram_pending = false;
+
+	/*
+	 * Pacing: only the first slice's share is available for now. An
+	 * adaptive window is paced at least per period, or a CPU could use the
+	 * credit of all its periods in a single burst.
+	 */
+	resource_info->slice = 0;
+	resource_info->nr_slices = min(archmon_nr_slices(resource_info->period) << resource_info->period_shift, 
+			ARCHMON_MAX_SLICES);
+	resource_info->credit = div64_u64(resource_info->credit, resource_info->nr_slices);
+
+	/* If there are throttled threads, then need to unlock */
+	if ( archmon_is_throttled(resource_info) ) {
+		archmon_unthrottle(resource_info);
+	}
+
+	/* 
+	 * Reconfiguring the period to reflect new credit on the sampling period 
+	 * and restart the perf event
+	 */
+	archmon_set_sample_period(resource_info, resource_info->credit);
+	archmon_start_events(resource_info);
+}
+
+/*
+ *	Periodic timer, also fires at the slice boundaries in pacing mode
+ */
+enum hrtimer_restart archmon_period_timer(struct hrtimer* timer)
+{
+	int overrun;
+	ktime_t now, last_start;
+	struct pcpu_shared_resources_info* resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, smp_processor_id());
+	ktime_t period = resource_info->period;
+	u64 start = local_clock();
+
+	if ( ktime_before(hrtimer_get_expires(timer), resource_info->period_end) ) {
+		if ( ktime_before(hrtimer_cb_get_time(timer), resource_info->period_end) ) {
+			do_archmon_slice_timer(resource_info);
+			hrtimer_set_expires(timer, archmon_slice_boundary(resource_info, resource_info->slice + 1));
+			goto out;
+		}
+
+		/* Late enough to have missed the period boundary */
+		hrtimer_set_expires(timer, resource_info->period_end);
+	}
+
+	last_start = resource_info->period_start;
+	resource_info->period_start = hrtimer_get_expires(timer);
+
+	for (;;) {
+		now = hrtimer_cb_get_time(timer);
+		overrun = hrtimer_forward(timer, now, resource_info->period);
+		
+		if (!overrun)
+			break;
+		
+		do_archmon_period_timer(last_start);
+		last_start = resource_info->period_start;
+	}
+
+	/* The period was retuned, move onto the boundaries of the new one */
+	if ( ktime_to_ns(resource_info->period) != ktime_to_ns(period) ) {
+		hrtimer_set_expires(timer, archmon_next_boundary(resource_info->period));
+	}
+	/* The timer restarts from archmon_wake() */
+	if ( resource_info->idle ) {
+		archmon_stop_events(resource_info);
+		archmon_set_sample_period(resource_info, resource_info->credit_per_period >> ADAPT_WAKE_SHIFT);
+		archmon_start_events(resource_info);
+		archmon_hist_add(ARCHMON_HIST_TIMER, local_clock() - start);
+		return HRTIMER_NORESTART;
+	}
+
+	/* Adaptive period: the window spans several periods */
+	hrtimer_add_expires(timer, ns_to_ktime((ktime_to_ns(resource_info->period) << resource_info->period_shift) - 
+				ktime_to_ns(resource_info->period)));
+	resource_info->period_end = hrtimer_get_expires(timer);
+
+	if ( resource_info->nr_slices > 1 ) {
+		hrtimer_set_expires(timer, archmon_slice_boundary(resource_info, 1));
+	}
+
+out:
+	archmon_hist_add(ARCHMON_HIST_TIMER, local_clock() - start);
+	return HRTIMER_RESTART;
+}
+
+
+/*
+ *	Must run on the CPU of resource_info, the timer is pinned
+ */
+void init_archmon_timer(struct pcpu_shared_resources_info* resource_info)
+{
+	ktime_t boundary = archmon_next_boundary(resource_info->period);
+
+	resource_info->period_start = ktime_sub(boundary, resource_info->period);
+	resource_info->period_end = boundary;
+	hrtimer_start(&resource_info->period_timer, boundary, HRTIMER_MODE_ABS_PINNED);
+}
+
+void cleanup_archmon_timer(struct pcpu_shared_resources_info* resource_info)
+{
+	hrtimer_cancel(&resource_info->period_timer);
+}
+
+/*
+ *	Events charged against the credit
+ */
+static int archmon_event_descs(struct archmon_event_desc* descs)
+{
+	int nr = 0;
+
+	/* No notion of LLC fills, the estimate sees an idle cache */
+	if ( counter_backend == ARCHMON_BACKEND_SW ) {
+		descs[nr++] = (struct archmon_event_desc){ "sw-event", PERF_TYPE_SOFTWARE, sw_event, 1, false, false };
+		return nr;
+	}
+
+	if ( count_mode == ARCHMON_COUNT_MISSES ) {
+		descs[nr++] = (struct archmon_event_desc){ "llc-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 1, false, true };
+		return nr;
+	}
+
+	descs[nr++] = (struct archmon_event_desc){ "llc-read-misses", PERF_TYPE_HW_CACHE, 
+		PERF_HW_CACHE_CONFIG(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), read_weight, false, true };
+
+	if ( writeback_event ) {
+		descs[nr++] = (struct archmon_event_desc){ "llc-writebacks", PERF_TYPE_RAW, writeback_event, write_weight, false, false };
+	} else {
+		descs[nr++] = (struct archmon_event_desc){ "llc-write-misses", PERF_TYPE_HW_CACHE, 
+			PERF_HW_CACHE_CONFIG(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_WRITE, PERF_COUNT_HW_CACHE_RESULT_MISS), write_weight, false, true };
+	}
+
+	if ( count_prefetch ) {
+		descs[nr++] = (struct archmon_event_desc){ "llc-prefetch-misses", PERF_TYPE_HW_CACHE, 
+			PERF_HW_CACHE_CONFIG(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_PREFETCH, PERF_COUNT_HW_CACHE_RESULT_MISS), prefetch_weight, true, true };
+	}
+
+	return nr;
+}
+
+static int init_archmon_events(struct pcpu_shared_resources_info* resource_info, int cpu_id)
+{
+	struct archmon_event_desc descs[ARCHMON_MAX_EVENTS];
+	int i, nr = archmon_event_descs(descs);
+
+	resource_info->nr_perf_events = 0;
+	resource_info->fill_events = 0;
+
+	for ( i = 0; i < nr; i++ ) {
+		unsigned int weight = max(descs[i].weight, 1U);
+		struct perf_event* event = reprogram_counter(cpu_id, descs[i].type, descs[i].config, false, true, 
+				max(div64_u64(resource_info->l3c_miss_sample_period, (u64)weight * nr), 1ULL), 
+				(perf_overflow_handler_t)perf_l3c_miss_overflow);
+
+		if ( NULL == event ) {
+			printk(KERN_ERR "[%d] cannot count %s\n", cpu_id, descs[i].name);
+			if ( descs[i].optional ) {
+				continue;
+			}
+			return -1;
+		}
+
+		resource_info->perf_events[resource_info->nr_perf_events] = event;
+		resource_info->event_weights[resource_info->nr_perf_events] = weight;
+		if ( descs[i].fill ) {
+			resource_info->fill_events |= 1U << resource_info->nr_perf_events;
+		}
+		resource_info->nr_perf_events++;
+	}
+
+	return 0;
+}
+
+static void archmon_perf_release(struct pcpu_shared_resources_info* resource_info)
+{
+	int i;
+
+	for ( i = 0; i < resource_info->nr_perf_events; i++ ) {
+		stop_counter(resource_info->perf_events[i]);
+	}
+	resource_info->nr_perf_events = 0;
+}
+
+static void archmon_perf_stop(struct pcpu_shared_resources_info* resource_info)
+{
+	int i;
+
+	for ( i = 0; i < resource_info->nr_perf_events; i++ ) {
+		struct perf_event* event = resource_info->perf_events[i];
+		event->pmu->stop(event, PERF_EF_UPDATE);
+	}
+}
+
+static void archmon_perf_start(struct pcpu_shared_resources_info* resource_info)
+{
+	int i;
+
+	for ( i = 0; i < resource_info->nr_perf_events; i++ ) {
+		struct perf_event* event = resource_info->perf_events[i];
+		event->pmu->start(event, PERF_EF_RELOAD);
+	}
+}
+
+/*
+ *	Weighted sum of all events. Counts are only up to date for stopped
+ *	events and the one that overflowed, so 'live' reads the others from the
+ *	PMU (NMI safe).
+ */
+static u64 archmon_perf_read(struct pcpu_shared_resources_info* resource_info, bool live)
+{
+	u64 traffic = 0, count;
+	int i;
+
+	for ( i = 0; i < resource_info->nr_perf_events; i++ ) {
+		struct perf_event* event = resource_info->perf_events[i];
+
+		if ( !live || resource_info->nr_perf_events == 1 || perf_event_read_local(event, &count, NULL, NULL) ) {
+			count = local64_read(&event->count);
+		}
+		traffic += count * resource_info->event_weights[i];
+	}
+
+	return traffic;
+}
+
+static u64 archmon_perf_read_fills(struct pcpu_shared_resources_info* resource_info)
+{
+	u64 fills = 0;
+	int i;
+
+	for ( i = 0; i < resource_info->nr_perf_events; i++ ) {
+		if ( resource_info->fill_events & (1U << i) ) {
+			fills += local64_read(&resource_info->perf_events[i]->count);
+		}
+	}
+
+	return fills;
+}
+
+/*
+ *	The credit is split over the events, so that together they cannot go
+ *	past it before one overflows. Whatever is left afterwards is split
+ *	again, see archmon_reprogram().
+ */
+static u64 archmon_event_period(struct pcpu_shared_resources_info* resource_info, int i, u64 credit)
+{
+	return max(div64_u64(credit, (u64)resource_info->event_weights[i] * resource_info->nr_perf_events), 1ULL);
+}
+
+static void archmon_perf_set_period(struct pcpu_shared_resources_info* resource_info, u64 credit)
+{
+	int i;
+
+	for ( i = 0; i < resource_info->nr_perf_events; i++ ) {
+		struct perf_event* event = resource_info->perf_events[i];
+		u64 sample_period = archmon_event_period(resource_info, i, credit);
+
+		event->hw.sample_period = sample_period;
+		local64_set(&event->hw.period_left, sample_period);
+	}
+}
+
+/*
+ *	Software events count period_left up from -sample_period and overflow
+ *	once it is no longer negative, charging last_period
+ */
+static void archmon_sw_set_period(struct pcpu_shared_resources_info* resource_info, u64 credit)
+{
+	int i;
+
+	for ( i = 0; i < resource_info->nr_perf_events; i++ ) {
+		struct perf_event* event = resource_info->perf_events[i];
+		u64 sample_period = archmon_event_period(resource_info, i, credit);
+
+		event->hw.sample_period = sample_period;
+		event->hw.last_period = sample_period;
+		local64_set(&event->hw.period_left, -(s64)sample_period);
+	}
+}
+
+static const struct archmon_backend archmon_perf_backend = {
+	.name = "perf",
+	.init = init_archmon_events,
+	.release = archmon_perf_release,
+	.stop = archmon_perf_stop,
+	.start = archmon_perf_start,
+	.read = archmon_perf_read,
+	.read_fills = archmon_perf_read_fills,
+	.set_period = archmon_perf_set_period,
+};
+
+static const struct archmon_backend archmon_sw_backend = {
+	.name = "software",
+	.init = init_archmon_events,
+	.release = archmon_perf_release,
+	.stop = archmon_perf_stop,
+	.start = archmon_perf_start,
+	.read = archmon_perf_read,
+	.read_fills = archmon_perf_read_fills,
+	.set_period = archmon_sw_set_period,
+};
+
+/*
+ *	Synthetic backend: misses only come from writes to cpuN/inject, so the
+ *	credit, throttle and refill paths run the same on any machine. Every
+ *	injected miss counts as an LLC fill.
+ */
+static int archmon_synth_init(struct pcpu_shared_resources_info* resource_info, int cpu_id)
+{
+	resource_info->synth_count = 0;
+	resource_info->synth_charged = 0;
+	resource_info->synth_period = max_t(u64, resource_info->l3c_miss_sample_period, 1);
+	resource_info->synth_left = resource_info->synth_period;
+	resource_info->synth_running = true;
+
+	return 0;
+}
+
+static void archmon_synth_release(struct pcpu_shared_resources_info* resource_info)
+{
+	resource_info->synth_running = false;
+}
+
+static void archmon_synth_stop(struct pcpu_shared_resources_info* resource_info)
+{
+	resource_info->synth_running = false;
+}
+
+static void archmon_synth_start(struct pcpu_shared_resources_info* resource_info)
+{
+	resource_info->synth_running = true;
+}
+
+static u64 archmon_synth_read(struct pcpu_shared_resources_info* resource_info, bool live)
+{
+	return resource_info->synth_count;
+}
+
+static u64 archmon_synth_read_fills(struct pcpu_shared_resources_info* resource_info)
+{
+	return resource_info->synth_count;
+}
+
+static void archmon_synth_set_period(struct pcpu_shared_resources_info* resource_info, u64 credit)
+{
+	resource_info->synth_period = max(credit, 1ULL);
+	resource_info->synth_left = resource_info->synth_period;
+}
+
+static const struct archmon_backend archmon_synth_backend = {
+	.name = "synthetic",
+	.init = archmon_synth_init,
+	.release = archmon_synth_release,
+	.stop = archmon_synth_stop,
+	.start = archmon_synth_start,
+	.read = archmon_synth_read,
+	.read_fills = archmon_synth_read_fills,
+	.set_period = archmon_synth_set_period,
+};
+
+static const struct archmon_backend* archmon_backends[ARCHMON_NR_BACKENDS] = {
+	[ARCHMON_BACKEND_HW] = &archmon_perf_backend,
+	[ARCHMON_BACKEND_SW] = &archmon_sw_backend,
+	[ARCHMON_BACKEND_SYNTHETIC] = &archmon_synth_backend,
+};
+
+/*
+ *	Count injected misses, runs on the CPU they are injected on. Like a
+ *	late PMI, a single overflow covers all the periods crossed at once.
+ */
+static void archmon_synth_inject(void* info)
+{
+	struct pcpu_shared_resources_info* resource_info = this_cpu_ptr(g_archmon_info.pcpu_resources_info);
+	u64 misses = *(u64*)info;
+	u64 charged;
+
+	if ( !resource_info->counting || !resource_info->synth_running ) {
+		return;
+	}
+
+	resource_info->synth_count += misses;
+	if ( misses < resource_info->synth_left ) {
+		resource_info->synth_left -= misses;
+		return;
+	}
+
+	charged = resource_info->synth_count - resource_info->synth_charged;
+	resource_info->synth_charged = resource_info->synth_count;
+	resource_info->synth_left = resource_info->synth_period;
+
+	archmon_overflow(resource_info, charged);
+}
+
+int init_archmon_percpu(struct pcpu_shared_resources_info* resource_info, int cpu_id)
+{
+	u64 credit_per_cpu = 0;
+
+	archmon_apply_config(resource_info);
+	credit_per_cpu = resource_info->credit_per_period;
+	printk(KERN_INFO "[%d] credit: %llu\n", cpu_id, credit_per_cpu);
+
+	resource_info->l3c_miss_sample_period = credit_per_cpu;
+	resource_info->credit = credit_per_cpu;
+	resource_info->credit_base = 0;
+	resource_info->period_base = 0;
+	resource_info->period_credit = credit_per_cpu;
+	resource_info->period_grant = credit_per_cpu;
+	resource_info->nr_slices = 1;
+	resource_info->slice = 0;
+	resource_info->period_shift = 0;
+	resource_info->idle = false;
+	resource_info->wake_pending = false;
+	resource_info->fill_base = 0;
+	resource_info->cache_scale = 1U << CACHE_SCALE_SHIFT;
+	resource_info->ring = g_archmon_info.telemetry + cpu_id * ARCHMON_RING_BYTES;
+	resource_info->throttled = false;
+	resource_info->throttle_mode = throttle_mode;
+	INIT_LIST_HEAD(&resource_info->throttled_tasks);
+
+	init_irq_work(&resource_info->throttle_work, archmon_throttle_work);
+	resource_info->overflow_pending = false;
+
+	init_waitqueue_head(&resource_info->throttle_evt);
+	resource_info->throttle_thread = kthread_create_on_node(archmon_throttle_thread, resource_info, 
+			cpu_to_node(cpu_id), "archmon_throttle/%d", cpu_id);
+
+	if ( IS_ERR(resource_info->throttle_thread) ) {
+		printk(KERN_ERR "[%d] cannot create a throttle thread\n", cpu_id);
+		resource_info->throttle_thread = NULL;
+		return -1;
+	}
+
+	kthread_bind(resource_info->throttle_thread, cpu_id);
+	wake_up_process(resource_info->throttle_thread);
+		
+	if ( g_archmon_info.backend->init(resource_info, cpu_id) == -1 ) {
+		printk(KERN_ERR "[%d] cannot initialize the %s counters\n", cpu_id, g_archmon_info.backend->name);
+		return -1;
+	}
+	resource_info->counting = true;
+
+	return 0;
+}
+
+/*
+ *	Occupancy in KB. Writes are taken as measured ground truth (e.g. from
+ *	resctrl llc_occupancy) and replace the estimate at the next boundary.
+ */
+static int archmon_llc_occupancy_get(void* data, u64* val)
+{
+	struct pcpu_shared_resources_info* resource_info = data;
+
+	*val = READ_ONCE(resource_info->llc_occupancy) / 1024;
+	return 0;
+}
+
+static int archmon_llc_occupancy_set(void* data, u64 val)
+{
+	struct pcpu_shared_resources_info* resource_info = data;
+
+	/* 0 would mean no measurement */
+	WRITE_ONCE(resource_info->llc_measured, max(val * 1024, 1ULL));
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(llc_occupancy_fops, archmon_llc_occupancy_get, archmon_llc_occupancy_set, "%llu\n");
+
+/*
+ *	Misses for the synthetic backend, charged on the CPU as if it had
+ *	missed in the LLC. Write-only.
+ */
+static int archmon_inject_set(void* data, u64 val)
+{
+	struct pcpu_shared_resources_info* resource_info = data;
+
+	return smp_call_function_single(resource_info->cpu_id, archmon_synth_inject, &val, 1);
+}
+DEFINE_DEBUGFS_ATTRIBUTE(inject_fops, NULL, archmon_inject_set, "%llu\n");
+
+/*
+ *	/sys/kernel/debug/archmon/histograms (all CPUs) and cpuN/histograms
+ */
+static int archmon_hists_show(struct seq_file* m, void* v)
+{
+	struct archmon_hists* hists = m->private;
+	int type, bucket, cpu_id;
+	u64 count;
+
+	for ( type = 0; type < ARCHMON_NR_HISTS; type++ ) {
+		seq_printf(m, "%s\n", archmon_hist_names[type]);
+
+		for ( bucket = 0; bucket < ARCHMON_HIST_BUCKETS; bucket++ ) {
+			if ( hists ) {
+				count = local64_read(&hists->count[type][bucket]);
+			} else {
+				count = 0;
+				for_each_possible_cpu(cpu_id) {
+					count += local64_read(&per_cpu_ptr(g_archmon_info.hists, cpu_id)->count[type][bucket]);
+				}
+			}
+
+			if ( count ) {
+				seq_printf(m, "%12llu ns: %llu\n", 1ULL << bucket, count);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int archmon_hists_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, archmon_hists_show, inode->i_private);
+}
+
+static const struct file_operations archmon_hists_fops = {
+	.owner = THIS_MODULE,
+	.open = archmon_hists_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ *	/sys/kernel/debug/archmon/cpuN/
+ */
+static void archmon_debugfs_percpu(struct pcpu_shared_resources_info* resource_info, int cpu_id)
+{
+	char name[16];
+
+	/* Unloading, see cleanup_module() */
+	if ( !g_archmon_info.debugfs_dir ) {
+		return;
+	}
+
+	snprintf(name, sizeof(name), "cpu%d", cpu_id);
+	resource_info->debugfs_dir = debugfs_create_dir(name, g_archmon_info.debugfs_dir);
+
+	debugfs_create_file_unsafe("credit", 0644, resource_info->debugfs_dir, resource_info, &credit_override_fops);
+	debugfs_create_u64("credit_per_period", 0444, resource_info->debugfs_dir, &resource_info->credit_per_period);
+	debugfs_create_file_unsafe("mbps", 0644, resource_info->debugfs_dir, resource_info, &mbps_fops);
+	debugfs_create_u64("bucket_depth", 0644, resource_info->debugfs_dir, &resource_info->bucket_depth);
+	debugfs_create_file_unsafe("bw_reserve", 0644, resource_info->debugfs_dir, resource_info, &bw_reserve_fops);
+	debugfs_create_u64("bw_limit", 0644, resource_info->debugfs_dir, &resource_info->bw_limit);
+	debugfs_create_u64("cache_reserve", 0644, resource_info->debugfs_dir, &resource_info->cache_reserve);
+	debugfs_create_u64("cache_limit", 0644, resource_info->debugfs_dir, &resource_info->cache_limit);
+	debugfs_create_file_unsafe("llc_occupancy", 0644, resource_info->debugfs_dir, resource_info, &llc_occupancy_fops);
+	debugfs_create_u32("cache_scale", 0444, resource_info->debugfs_dir, &resource_info->cache_scale);
+	debugfs_create_file("histograms", 0444, resource_info->debugfs_dir, per_cpu_ptr(g_archmon_info.hists, cpu_id), &archmon_hists_fops);
+
+	if ( g_archmon_info.backend == &archmon_synth_backend ) {
+		debugfs_create_file_unsafe("inject", 0200, resource_info->debugfs_dir, resource_info, &inject_fops);
+	}
+}
+
+/*
+ *	Slot of the LLC a CPU belongs to, in the order LLCs are first seen, -1
+ *	once they are all taken. Only called at init and from the hotplug
+ *	callbacks, which do not run concurrently.
+ */
+static int archmon_llc_slot(int cpu_id)
+{
+	int llc_key, slot;
+
+#ifdef CONFIG_X86
+	/* A package can have several LLCs, e.g. one per CCX on AMD */
+	llc_key = get_llc_id(cpu_id);
+#else
+	llc_key = topology_physical_package_id(cpu_id);
+#endif
+
+	for ( slot = 0; slot < g_archmon_info.nr_llcs; slot++ ) {
+		if ( g_archmon_info.llc_keys[slot] == llc_key ) {
+			return slot;
+		}
+	}
+
+	if ( g_archmon_info.nr_llcs == ARCHMON_MAX_LLCS ) {
+		return -1;
+	}
+
+	g_archmon_info.llc_keys[slot] = llc_key;
+	return g_archmon_info.nr_llcs++;
+}
+
+/*
+ *	Uncore IMC state of a CPU's socket, NULL past ARCHMON_MAX_PACKAGES
+ */
+static struct archmon_package* archmon_package(int cpu_id)
+{
+	int package_id = topology_physical_package_id(cpu_id);
+
+	if ( package_id < 0 || package_id >= ARCHMON_MAX_PACKAGES ) {
+		return NULL;
+	}
+
+	return &g_archmon_info.packages[package_id];
+}
+
+/*
+ *	CPU hotplug: release a CPU, runs on that CPU before it goes down.
+ *	Also used to undo a partially initialized CPU.
+ */
+static int archmon_cpu_offline(unsigned int cpu_id)
+{
+	struct pcpu_shared_resources_info* resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, cpu_id);
+
+	/* 
+	 * A pending irq_work could restart the timer from archmon_wake(),
+	 * only cancel it once none can be queued any more
+	 */
+	resource_info->counting = false;
+	g_archmon_info.backend->release(resource_info);
+	irq_work_sync(&resource_info->throttle_work);
+	cleanup_archmon_timer(resource_info);
+
+	/* Nobody would resume it otherwise */
+	if ( archmon_is_throttled(resource_info) ) {
+		archmon_unthrottle(resource_info);
+	}
+
+	if ( resource_info->throttle_thread ) {
+		kthread_stop(resource_info->throttle_thread);
+		resource_info->throttle_thread = NULL;
+	}
+
+	debugfs_remove_recursive(resource_info->debugfs_dir);
+	resource_info->debugfs_dir = NULL;
+	archmon_account_reserve(resource_info, false);
+
+	atomic_dec(&g_archmon_info.llcs[resource_info->llc_id].nr_cpus);
+	if ( resource_info->cache_unmet ) {
+		atomic_dec(&g_archmon_info.llcs[resource_info->llc_id].cache_unmet);
+	}
+
+	atomic64_add(resource_info->overflow_count, &g_archmon_info.overflow_count);
+	atomic64_add(resource_info->overflow_ns, &g_archmon_info.overflow_ns);
+	if ( resource_info->overflow_max_ns > atomic64_read(&g_archmon_info.overflow_max_ns) ) {
+		atomic64_set(&g_archmon_info.overflow_max_ns, resource_info->overflow_max_ns);
+	}
+
+	/* The remaining CPUs take over its share at their next boundary */
+	atomic_dec(&resource_info->node->nr_cpus);
+	atomic_dec(&g_archmon_info.nr_cpus);
+	archmon_config_changed();
+
+	printk(KERN_INFO "[%d] cpu is not regulated anymore\n", cpu_id);
+	return 0;
+}
+
+/*
+ *	CPU hotplug: bring a CPU under regulation, runs on that CPU
+ */
+static int archmon_cpu_online(unsigned int cpu_id)
+{
+	struct pcpu_shared_resources_info* resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, cpu_id);
+	u64 credit_override = resource_info->credit_override;
+	u64 mbps_override = resource_info->mbps_override;
+	u64 bucket_depth = resource_info->bucket_depth;
+	u64 bw_reserve = resource_info->bw_reserve;
+	u64 bw_limit = resource_info->bw_limit;
+	u64 cache_reserve = resource_info->cache_reserve;
+	u64 cache_limit = resource_info->cache_limit;
+	int llc_id = archmon_llc_slot(cpu_id);
+
+	if ( llc_id < 0 ) {
+		printk(KERN_ERR "[%d] more than %d LLCs, cannot regulate this cpu\n", cpu_id, ARCHMON_MAX_LLCS);
+		return -ENOSPC;
+	}
+
+	/* Start from scratch, only the configured budget survives offlining */
+	memset(resource_info, 0, sizeof(*resource_info));
+	resource_info->cpu_id = cpu_id;
+	resource_info->credit_override = credit_override;
+	resource_info->mbps_override = mbps_override;
+	resource_info->bucket_depth = bucket_depth;
+	resource_info->bw_reserve = bw_reserve;
+	resource_info->bw_limit = bw_limit;
+	resource_info->cache_reserve = cache_reserve;
+	resource_info->cache_limit = cache_limit;
+
+	hrtimer_init(&resource_info->period_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_PINNED);
+	resource_info->period_timer.function = archmon_period_timer;
+
+	/* Rebalance: the other CPUs give up some credit at their next boundary */
+	resource_info->node = g_archmon_info.nodes[cpu_to_node(cpu_id)];
+	atomic_inc(&resource_info->node->nr_cpus);
+	atomic_inc(&g_archmon_info.nr_cpus);
+	archmon_account_reserve(resource_info, true);
+
+	/* Occupancy starts from an empty cache */
+	resource_info->llc_id = llc_id;
+	resource_info->package = archmon_package(cpu_id);
+	atomic_inc(&g_archmon_info.llcs[resource_info->llc_id].nr_cpus);
+	resource_info->llc_fills_seen = atomic64_read(&g_archmon_info.llcs[resource_info->llc_id].fills);
+	archmon_config_changed();
+
+	if ( init_archmon_percpu(resource_info, cpu_id) == -1 ) {
+		archmon_cpu_offline(cpu_id);
+		return -ENODEV;
+	}
+
+	archmon_debugfs_percpu(resource_info, cpu_id);
+	init_archmon_timer(resource_info);
+
+	return 0;
+}
+
+/*
+ *	Give a cgroup a budget, or update the budget of a known one
+ */
+static int archmon_group_set(const char* path, u64 budget, u64 mbps, u64 depth)
+{
+	struct archmon_group* group;
+	struct cgroup* cgrp;
+	int slot, cpu_id;
+
+	if ( mbps ) {
+		budget = archmon_mbps_to_credit(mbps, READ_ONCE(period_us));
+	}
+
+	mutex_lock(&g_archmon_info.group_lock);
+
+	list_for_each_entry(group, &g_archmon_info.group_list, list) {
+		if ( strcmp(group->path, path) == 0 ) {
+			/* Takes effect at the next refill */
+			WRITE_ONCE(group->budget, budget);
+			WRITE_ONCE(group->mbps, mbps);
+			WRITE_ONCE(group->depth, depth);
+			mutex_unlock(&g_archmon_info.group_lock);
+			return 0;
+		}
+	}
+
+	for ( slot = 0; slot < ARCHMON_MAX_GROUPS; slot++ ) {
+		if ( !g_archmon_info.groups[slot] ) {
+			break;
+		}
+	}
+
+	if ( slot == ARCHMON_MAX_GROUPS ) {
+		mutex_unlock(&g_archmon_info.group_lock);
+		return -ENOSPC;
+	}
+
+	cgrp = cgroup_get_from_path(path);
+	if ( IS_ERR(cgrp) ) {
+		mutex_unlock(&g_archmon_info.group_lock);
+		return PTR_ERR(cgrp);
+	}
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if ( group ) {
+		group->path = kstrdup(path, GFP_KERNEL);
+	}
+
+	if ( !group || !group->path ) {
+		kfree(group);
+		cgroup_put(cgrp);
+		mutex_unlock(&g_archmon_info.group_lock);
+		return -ENOMEM;
+	}
+
+	group->cgrp = cgrp;
+	group->slot = slot;
+	group->budget = budget;
+	group->mbps = mbps;
+	group->depth = depth;
+	atomic64_set(&group->remaining, budget);
+
+	for_each_possible_cpu(cpu_id) {
+		struct pcpu_shared_resources_info* resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, cpu_id);
+		memset(&resource_info->groups[slot], 0, sizeof(struct pcpu_group_info));
+	}
+
+	g_archmon_info.groups[slot] = group;
+	list_add_tail_rcu(&group->list, &g_archmon_info.group_list);
+	hlist_add_head_rcu(&group->hash_node, &g_archmon_info.group_hash[hash_ptr(cgrp, ARCHMON_GROUP_HASH_BITS)]);
+	WRITE_ONCE(g_archmon_info.nr_groups, g_archmon_info.nr_groups + 1);
+
+	mutex_unlock(&g_archmon_info.group_lock);
+	return 0;
+}
+
+/*
+ *	Called with group_lock held
+ */
+static void archmon_group_del(struct archmon_group* group)
+{
+	hlist_del_rcu(&group->hash_node);
+	list_del_rcu(&group->list);
+	WRITE_ONCE(g_archmon_info.nr_groups, g_archmon_info.nr_groups - 1);
+
+	/* The overflow handler and period timers may still look at it */
+	synchronize_rcu();
+
+	g_archmon_info.groups[group->slot] = NULL;
+	cgroup_put(group->cgrp);
+	kfree(group->path);
+	kfree(group);
+}
+
+static int archmon_group_remove(const char* path)
+{
+	struct archmon_group* group;
+	int ret = -ENOENT;
+
+	mutex_lock(&g_archmon_info.group_lock);
+	list_for_each_entry(group, &g_archmon_info.group_list, list) {
+		if ( strcmp(group->path, path) == 0 ) {
+			archmon_group_del(group);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&g_archmon_info.group_lock);
+
+	return ret;
+}
+
+/*
+ *	/sys/kernel/debug/archmon/groups
+ *
+ *	"<cgroup path> <credit per period>[MB/s] [bucket depth]" sets a budget, a
+ *	budget of 0 removes the group. Paths are relative to the cgroup2 mount.
+ *	Budgets with a MB/s suffix follow period changes.
+ */
+static int archmon_groups_show(struct seq_file* m, void* v)
+{
+	struct archmon_group* group;
+
+	u64 us = READ_ONCE(period_us);
+
+	seq_printf(m, "# path budget MB/s depth usage throttled\n");
+
+	mutex_lock(&g_archmon_info.group_lock);
+	list_for_each_entry(group, &g_archmon_info.group_list, list) {
+		seq_printf(m, "%s %llu %llu %llu %lld %lld\n", group->path, group->budget, 
+				archmon_credit_to_mbps(group->budget, us), group->depth, 
+				(long long)atomic64_read(&group->usage), (long long)atomic64_read(&group->throttle_count));
+	}
+	mutex_unlock(&g_archmon_info.group_lock);
+
+	return 0;
+}
+
+static int archmon_groups_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, archmon_groups_show, NULL);
+}
+
+static ssize_t archmon_groups_write(struct file* file, const char __user* ubuf, size_t len, loff_t* ppos)
+{
+	char path[256], budget_str[32], unit[8];
+	unsigned long long budget, mbps = 0, depth = 0;
+	char* buf;
+	int ret;
+
+	buf = memdup_user_nul(ubuf, len);
+	if ( IS_ERR(buf) ) {
+		return PTR_ERR(buf);
+	}
+
+	if ( sscanf(buf, "%255s %31s %llu", path, budget_str, &depth) < 2 ) {
+		ret = -EINVAL;
+	} else if ( (ret = sscanf(budget_str, "%llu%7s", &budget, unit)) < 1 || (ret == 2 && strcmp(unit, "MB/s")) ) {
+		ret = -EINVAL;
+	} else if ( budget ) {
+		if ( ret == 2 ) {
+			mbps = budget;
+		}
+		ret = archmon_group_set(path, budget, mbps, depth);
+	} else {
+		ret = archmon_group_remove(path);
+	}
+
+	kfree(buf);
+	return ret ? ret : len;
+}
+
+static const struct file_operations archmon_groups_fops = {
+	.owner = THIS_MODULE,
+	.open = archmon_groups_open,
+	.read = seq_read,
+	.write = archmon_groups_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int archmon_exempt_add(const char* path)
+{
+	struct archmon_exempt* exempt;
+	struct cgroup* cgrp;
+	int i, slot = -1;
+
+	mutex_lock(&g_archmon_info.group_lock);
+
+	for ( i = 0; i < ARCHMON_MAX_EXEMPT; i++ ) {
+		exempt = rcu_dereference_protected(g_archmon_info.exempt[i], lockdep_is_held(&g_archmon_info.group_lock));
+		if ( !exempt ) {
+			slot = slot < 0 ? i : slot;
+		} else if ( strcmp(exempt->path, path) == 0 ) {
+			mutex_unlock(&g_archmon_info.group_lock);
+			return 0;
+		}
+	}
+
+	if ( slot < 0 ) {
+		mutex_unlock(&g_archmon_info.group_lock);
+		return -ENOSPC;
+	}
+
+	cgrp = cgroup_get_from_path(path);
+	if ( IS_ERR(cgrp) ) {
+		mutex_unlock(&g_archmon_info.group_lock);
+		return PTR_ERR(cgrp);
+	}
+
+	exempt = kzalloc(sizeof(*exempt), GFP_KERNEL);
+	if ( exempt ) {
+		exempt->path = kstrdup(path, GFP_KERNEL);
+	}
+
+	if ( !exempt || !exempt->path ) {
+		kfree(exempt);
+		cgroup_put(cgrp);
+		mutex_unlock(&g_archmon_info.group_lock);
+		return -ENOMEM;
+	}
+
+	exempt->cgrp = cgrp;
+	rcu_assign_pointer(g_archmon_info.exempt[slot], exempt);
+	WRITE_ONCE(g_archmon_info.nr_exempt, g_archmon_info.nr_exempt + 1);
+
+	mutex_unlock(&g_archmon_info.group_lock);
+	return 0;
+}
+
+/*
+ *	Caller holds group_lock
+ */
+static void archmon_exempt_del(int slot)
+{
+	struct archmon_exempt* exempt = rcu_dereference_protected(g_archmon_info.exempt[slot], 
+			lockdep_is_held(&g_archmon_info.group_lock));
+
+	RCU_INIT_POINTER(g_archmon_info.exempt[slot], NULL);
+	WRITE_ONCE(g_archmon_info.nr_exempt, g_archmon_info.nr_exempt - 1);
+
+	/* The throttle paths may still look at it */
+	synchronize_rcu();
+
+	cgroup_put(exempt->cgrp);
+	kfree(exempt->path);
+	kfree(exempt);
+}
+
+static int archmon_exempt_remove(const char* path)
+{
+	struct archmon_exempt* exempt;
+	int i, ret = -ENOENT;
+
+	mutex_lock(&g_archmon_info.group_lock);
+	for ( i = 0; i < ARCHMON_MAX_EXEMPT; i++ ) {
+		exempt = rcu_dereference_protected(g_archmon_info.exempt[i], lockdep_is_held(&g_archmon_info.group_lock));
+		if ( exempt && strcmp(exempt->path, path) == 0 ) {
+			archmon_exempt_del(i);
+			ret = 0;
+			break;
+		}
+	}
+	mutex_unlock(&g_archmon_info.group_lock);
+
+	return ret;
+}
+
+/*
+ *	/sys/kernel/debug/archmon/exempt
+ *
+ *	"<cgroup path>" exempts a cgroup and its descendants from throttling,
+ *	"-<cgroup path>" removes it. Paths are relative to the cgroup2 mount.
+ */
+static int archmon_exempt_show(struct seq_file* m, void* v)
+{
+	struct archmon_exempt* exempt;
+	int i;
+
+	mutex_lock(&g_archmon_info.group_lock);
+	for ( i = 0; i < ARCHMON_MAX_EXEMPT; i++ ) {
+		exempt = rcu_dereference_protected(g_archmon_info.exempt[i], lockdep_is_held(&g_archmon_info.group_lock));
+		if ( exempt ) {
+			seq_printf(m, "%s\n", exempt->path);
+		}
+	}
+	mutex_unlock(&g_archmon_info.group_lock);
+
+	return 0;
+}
+
+static int archmon_exempt_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, archmon_exempt_show, NULL);
+}
+
+static ssize_t archmon_exempt_write(struct file* file, const char __user* ubuf, size_t len, loff_t* ppos)
+{
+	char path[256];
+	char* buf;
+	int ret;
+
+	buf = memdup_user_nul(ubuf, len);
+	if ( IS_ERR(buf) ) {
+		return PTR_ERR(buf);
+	}
+
+	if ( sscanf(buf, "%255s", path) != 1 ) {
+		ret = -EINVAL;
+	} else if ( path[0] == '-' ) {
+		ret = archmon_exempt_remove(path + 1);
+	} else {
+		ret = archmon_exempt_add(path);
+	}
+
+	kfree(buf);
+	return ret ? ret : len;
+}
+
+static const struct file_operations archmon_exempt_fops = {
+	.owner = THIS_MODULE,
+	.open = archmon_exempt_open,
+	.read = seq_read,
+	.write = archmon_exempt_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ *	/dev/archmon: mmap() the telemetry rings, poll() for the watermark,
+ *	ioctl() for batched control
+ */
+static int archmon_dev_mmap(struct file* file, struct vm_area_struct* vma)
+{
+	return remap_vmalloc_range(vma, g_archmon_info.telemetry, vma->vm_pgoff);
+}
+
+static __poll_t archmon_dev_poll(struct file* file, poll_table* wait)
+{
+	int cpu_id;
+
+	poll_wait(file, &g_archmon_info.telemetry_wq, wait);
+
+	for_each_online_cpu(cpu_id) {
+		struct archmon_ring* ring = g_archmon_info.telemetry + cpu_id * ARCHMON_RING_BYTES;
+
+		if ( smp_load_acquire(&ring->head) - READ_ONCE(ring->tail) >= READ_ONCE(telemetry_watermark) ) {
+			return EPOLLIN | EPOLLRDNORM;
+		}
+	}
+
+	return 0;
+}
+
+static bool archmon_budget_valid(const struct archmon_budget* budget)
+{
+	switch ( budget->target ) {
+	case ARCHMON_TARGET_CPU:
+		return budget->id < nr_cpu_ids && cpu_possible(budget->id);
+	case ARCHMON_TARGET_NODE:
+		return budget->id < MAX_NUMNODES && node_possible(budget->id);
+	case ARCHMON_TARGET_GROUP:
+		return budget->id < ARCHMON_MAX_GROUPS && g_archmon_info.groups[budget->id] && budget->mbps;
+	}
+
+	return false;
+}
+
+/*
+ *	ARCHMON_IOC_SET_BUDGETS: the same as writing the mbps files one by one,
+ *	with a single config change
+ */
+static long archmon_set_budgets(const struct archmon_batch* batch)
+{
+	struct archmon_budget* budgets;
+	struct archmon_group* group;
+	u32 i;
+	long ret = 0;
+
+	if ( batch->nr > ARCHMON_MAX_BATCH ) {
+		return -E2BIG;
+	}
+
+	budgets = memdup_user(u64_to_user_ptr(batch->ptr), batch->nr * sizeof(*budgets));
+	if ( IS_ERR(budgets) ) {
+		return PTR_ERR(budgets);
+	}
+
+	/* Groups cannot go away meanwhile */
+	mutex_lock(&g_archmon_info.group_lock);
+
+	for ( i = 0; i < batch->nr; i++ ) {
+		if ( !archmon_budget_valid(&budgets[i]) ) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	for ( i = 0; i < batch->nr; i++ ) {
+		switch ( budgets[i].target ) {
+		case ARCHMON_TARGET_CPU:
+			WRITE_ONCE(per_cpu_ptr(g_archmon_info.pcpu_resources_info, budgets[i].id)->mbps_override, budgets[i].mbps);
+			break;
+		case ARCHMON_TARGET_NODE:
+			WRITE_ONCE(g_archmon_info.nodes[budgets[i].id]->mbps, budgets[i].mbps);
+			break;
+		case ARCHMON_TARGET_GROUP:
+			/* Takes effect at the next refill */
+			group = g_archmon_info.groups[budgets[i].id];
+			WRITE_ONCE(group->budget, archmon_mbps_to_credit(budgets[i].mbps, READ_ONCE(period_us)));
+			WRITE_ONCE(group->mbps, budgets[i].mbps);
+			break;
+		}
+	}
+
+	archmon_config_changed();
+
+out:
+	mutex_unlock(&g_archmon_info.group_lock);
+	kfree(budgets);
+	return ret;
+}
+
+/*
+ *	ARCHMON_IOC_GET_GROUPS: what debugfs groups shows, without parsing
+ */
+static long archmon_get_groups(const struct archmon_batch* batch)
+{
+	struct archmon_group_stat* stats = NULL;
+	struct archmon_group* group;
+	u32 nr = min_t(u32, batch->nr, ARCHMON_MAX_GROUPS);
+	long n = 0;
+
+	if ( nr ) {
+		stats = kcalloc(nr, sizeof(*stats), GFP_KERNEL);
+		if ( !stats ) {
+			return -ENOMEM;
+		}
+	}
+
+	mutex_lock(&g_archmon_info.group_lock);
+	list_for_each_entry(group, &g_archmon_info.group_list, list) {
+		if ( n < nr ) {
+			stats[n].slot = group->slot;
+			stats[n].mbps = group->mbps;
+			stats[n].budget = group->budget;
+			stats[n].usage = atomic64_read(&group->usage);
+			stats[n].throttle_count = atomic64_read(&group->throttle_count);
+			strscpy(stats[n].path, group->path, sizeof(stats[n].path));
+		}
+		n++;
+	}
+	mutex_unlock(&g_archmon_info.group_lock);
+
+	if ( nr && copy_to_user(u64_to_user_ptr(batch->ptr), stats, min_t(long, n, nr) * sizeof(*stats)) ) {
+		n = -EFAULT;
+	}
 
+	kfree(stats);
+	return n;
+}
 
-struct pcpu_shared_resources_info {
-	
-	int bw_reserve;
-	int bw_limit;
+static long archmon_dev_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+	struct archmon_batch batch;
 
-	int cache_reserve;
-	int cache_limit;
+	if ( cmd != ARCHMON_IOC_SET_BUDGETS && cmd != ARCHMON_IOC_GET_GROUPS ) {
+		return -ENOTTY;
+	}
 
-	struct perf_event* perf_l3c_miss_event;
-	int l3c_miss_sample_period; 
+	if ( copy_from_user(&batch, (void __user*)arg, sizeof(batch)) ) {
+		return -EFAULT;
+	}
 
-	u64 credit;
-	u64 credit_per_period;
+	return cmd == ARCHMON_IOC_SET_BUDGETS ? archmon_set_budgets(&batch) : archmon_get_groups(&batch);
+}
 
-	struct task_struct* throttled_task;
-	bool throttled;
-	
-	struct hrtimer period_timer;
-	ktime_t	period;
+static const struct file_operations archmon_dev_fops = {
+	.owner = THIS_MODULE,
+	.mmap = archmon_dev_mmap,
+	.poll = archmon_dev_poll,
+	.unlocked_ioctl = archmon_dev_ioctl,
+	.compat_ioctl = archmon_dev_ioctl,
 };
 
-struct archmon_info {
-
-	struct pcpu_shared_resources_info* __percpu pcpu_resources_info;
-	int total_credit;
+static struct miscdevice archmon_dev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "archmon",
+	.fops = &archmon_dev_fops,
+	.mode = 0600,
 };
 
-static struct archmon_info g_archmon_info;
+static int archmon_telemetry_init(void)
+{
+	int cpu_id, ret;
+
+	BUILD_BUG_ON(sizeof(struct archmon_ring) + ARCHMON_RING_SIZE * sizeof(struct archmon_record) > ARCHMON_RING_BYTES);
+
+	init_waitqueue_head(&g_archmon_info.telemetry_wq);
+
+	g_archmon_info.telemetry = vmalloc_user(nr_cpu_ids * ARCHMON_RING_BYTES);
+	if ( !g_archmon_info.telemetry ) {
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu_id) {
+		struct archmon_ring* ring = g_archmon_info.telemetry + cpu_id * ARCHMON_RING_BYTES;
+
+		ring->size = ARCHMON_RING_SIZE;
+		ring->cpu = cpu_id;
+	}
+
+	ret = misc_register(&archmon_dev);
+	if ( ret ) {
+		vfree(g_archmon_info.telemetry);
+		g_archmon_info.telemetry = NULL;
+	}
+
+	return ret;
+}
+
+static void archmon_telemetry_release(void)
+{
+	misc_deregister(&archmon_dev);
+	vfree(g_archmon_info.telemetry);
+}
 
 /*
- *	L3 cache miss overflow callback
+ *	/sys/kernel/debug/archmon/nodeN/, one per possible node
  */
-static void perf_l3c_miss_overflow(struct perf_event* event, struct perf_sample_data* data, struct pt_regs* regs)
+static int archmon_nodes_init(void)
 {
-	struct pcpu_shared_resources_info* resource_info = this_cpu_ptr(g_archmon_info.pcpu_resources_info);
-	u64 used_credit = local64_read(&event->count);
+	struct archmon_node* node;
+	char name[16];
+	int nid;
 
-	if ( used_credit < resource_info->credit ) {
-		return;
+	for_each_node(nid) {
+		node = kzalloc_node(sizeof(*node), GFP_KERNEL, nid);
+		if ( !node ) {
+			return -ENOMEM;
+		}
+
+		node->id = nid;
+		atomic_set(&node->nr_cpus, 0);
+		atomic64_set(&node->credit_pool, 0);
+		atomic64_set(&node->credit_pool_epoch, 0);
+		atomic64_set(&node->calibrate_sum, 0);
+		atomic64_set(&node->calibrate_epoch, 0);
+		g_archmon_info.nodes[nid] = node;
+
+		snprintf(name, sizeof(name), "node%d", nid);
+		node->debugfs_dir = debugfs_create_dir(name, g_archmon_info.debugfs_dir);
+		debugfs_create_file_unsafe("credit", 0644, node->debugfs_dir, node, &node_credit_fops);
+		debugfs_create_file_unsafe("mbps", 0644, node->debugfs_dir, node, &node_mbps_fops);
+		debugfs_create_u64("peak_mbps", 0444, node->debugfs_dir, &node->peak_mbps);
 	}
-	
-	/* End up its credit! */
-	resource_info->credit = 0;
-	
-	/* need to throttle process running on the cpu */
-	if ( resource_info->throttled == true ) {
-#if AHN_DEBUG
-		printk(KERN_ERR "[%d] a process %d is still throttled down!\n", smp_processor_id(), current->pid);
-#endif
-		return;
+
+	return 0;
+}
+
+/*
+ *	Also undoes a partial archmon_nodes_init()
+ */
+static void archmon_nodes_release(void)
+{
+	int nid;
+
+	for_each_node(nid) {
+		kfree(g_archmon_info.nodes[nid]);
+		g_archmon_info.nodes[nid] = NULL;
 	}
+}
 
-	resource_info->throttled_task = current;
-	resource_info->throttled = true;
-	kill_pid(task_pid(current), SIGSTOP, 1);
-#if AHN_DEBUG
-	printk("[%d] a process %d needs to be throttled down \n", smp_processor_id(), current->pid);
-#endif
+static void archmon_imc_release(struct archmon_package* package)
+{
+	while ( package->nr_imc_events ) {
+		stop_counter(package->imc_events[--package->nr_imc_events]);
+	}
 }
 
 /*
- *	Create a performance counter (reference 'arch/x86/kvm/pmu.c')
+ *	Count the read and write CAS commands of every IMC of a socket
  */
-static struct perf_event* reprogram_counter(int cpu, u32 type, unsigned config, 
-		bool exclude_user, bool exclude_kernel, int period,  perf_overflow_handler_t callback)
+static int archmon_imc_init_package(struct archmon_package* package, int cpu_id)
 {
-	struct perf_event *event = NULL;
-	struct perf_event_attr attr = {
-		.type = type,
-		.config	= config,
-		.size = sizeof(struct perf_event_attr),
-		.exclude_user = exclude_user,
-		.exclude_kernel = exclude_kernel,
-		.pinned = true,
-		.sample_period = period,
-	};
+	u64 configs[2] = { imc_read_event, imc_write_event };
+	struct perf_event* event;
+	int i, j;
 
-	event = perf_event_create_kernel_counter(&attr, cpu, NULL, callback, NULL);
+	for ( i = 0; i < nr_imc_pmu_types; i++ ) {
+		for ( j = 0; j < 2; j++ ) {
+			event = reprogram_counter(cpu_id, imc_pmu_types[i], configs[j], false, false, 0, NULL);
+			if ( NULL == event ) {
+				archmon_imc_release(package);
+				return -1;
+			}
+			package->imc_events[package->nr_imc_events++] = event;
+		}
+	}
 
-	if ( IS_ERR(event) ) {
-		printk(KERN_ERR "pmu event creation failed %ld\n", PTR_ERR(event));
-		return NULL;
+	return 0;
+}
+
+/*
+ *	A socket whose IMCs cannot be counted keeps per-core budgets only
+ */
+static void archmon_imc_init(void)
+{
+	bool done[ARCHMON_MAX_PACKAGES] = { false };
+	struct archmon_package* package;
+	int cpu_id;
+
+	if ( !nr_imc_pmu_types ) {
+		return;
+	}
+
+	for_each_online_cpu(cpu_id) {
+		package = archmon_package(cpu_id);
+		if ( !package ) {
+			printk(KERN_ERR "[%d] package beyond %d, per-core budgets only\n", cpu_id, ARCHMON_MAX_PACKAGES);
+			continue;
+		}
+
+		if ( done[package - g_archmon_info.packages] ) {
+			continue;
+		}
+		done[package - g_archmon_info.packages] = true;
+
+		if ( archmon_imc_init_package(package, cpu_id) == -1 ) {
+			printk(KERN_ERR "[%d] cannot count IMC CAS commands, per-core budgets only\n", cpu_id);
+		}
+	}
+}
+
+static void archmon_imc_release_all(void)
+{
+	int package_id;
+
+	for ( package_id = 0; package_id < ARCHMON_MAX_PACKAGES; package_id++ ) {
+		archmon_imc_release(&g_archmon_info.packages[package_id]);
 	}
-	
-	return event;
 }
 
 /*
- * Release a performance counter
+ *	/sys/kernel/debug/archmon/dram
  */
-static void stop_counter(struct perf_event* event)
+static int archmon_dram_show(struct seq_file* m, void* v)
 {
-	if ( event ) {
-		perf_event_release_kernel(event);
+	int package_id;
+
+	seq_printf(m, "# package MB/s\n");
+	for ( package_id = 0; package_id < ARCHMON_MAX_PACKAGES; package_id++ ) {
+		if ( g_archmon_info.packages[package_id].nr_imc_events ) {
+			seq_printf(m, "%d %llu\n", package_id, READ_ONCE(g_archmon_info.packages[package_id].dram_mbps));
+		}
 	}
+
+	return 0;
+}
+
+static int archmon_dram_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, archmon_dram_show, NULL);
 }
 
+static const struct file_operations archmon_dram_fops = {
+	.owner = THIS_MODULE,
+	.open = archmon_dram_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
 /*
- * Do something
+ *	Bandwidth probe: one load per cache line, nothing but misses once the
+ *	buffers of a node add up to twice the LLC
  */
-static void do_archmon_period_timer(void)
+static int archmon_probe_thread(void* data)
 {
-	int cpu_id;
-	struct pcpu_shared_resources_info* resource_info;
-	struct perf_event* event;
+	struct archmon_probe* probe = data;
+	size_t i, stride = cache_line_size() / sizeof(u64);
 
-	cpu_id = smp_processor_id();
+	WRITE_ONCE(probe->start, ktime_get_ns());
 
-#if AHN_DEBUG
-	printk("[%d] timer invoked!\n", smp_processor_id());
-#endif
+	while ( !kthread_should_stop() ) {
+		for ( i = 0; i < probe->len / sizeof(u64); i += stride ) {
+			(void)READ_ONCE(probe->buf[i]);
+		}
+		WRITE_ONCE(probe->bytes, probe->bytes + probe->len);
+		cond_resched();
+	}
 
-	resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, cpu_id);
-	event = resource_info->perf_l3c_miss_event;
+	return 0;
+}
 
-	/* Stop the perf event */
-	event->pmu->stop(event, PERF_EF_UPDATE);
+static void archmon_probe_stop(void)
+{
+	struct archmon_probe* probe;
+	int cpu_id;
 
-	/* Reset the credit */
-	resource_info->credit = resource_info->credit_per_period;
+	if ( !g_archmon_info.probes ) {
+		return;
+	}
 
-	/* If there are throttled threads, then need to unlock */
-	if ( resource_info->throttled ) {
-		kill_pid(task_pid(resource_info->throttled_task), SIGCONT, 1);
-#if AHN_DEBUG
-		printk("[%d] a process %d needs to be throttled up \n", cpu_id, resource_info->throttled_task->pid);
-#endif
-		resource_info->throttled = false;
+	for_each_possible_cpu(cpu_id) {
+		probe = &g_archmon_info.probes[cpu_id];
+		if ( probe->task ) {
+			kthread_stop(probe->task);
+		}
+		vfree(probe->buf);
 	}
 
-	/* 
-	 * Reconfiguring the period to reflect new credit on the sampling period 
-	 * and restart the perf event
-	 */
-	local64_set(&event->hw.period_left, resource_info->credit);
-	event->pmu->start(event, PERF_EF_RELOAD);
+	kfree(g_archmon_info.probes);
+	g_archmon_info.probes = NULL;
 }
 
 /*
- *	Periodic timer
+ *	A probe thread on every online CPU, reading from memory of its node.
+ *	CPUs whose probe cannot be set up just do not add load.
  */
-enum hrtimer_restart archmon_period_timer(struct hrtimer* timer)
+static int archmon_probe_start(void)
 {
-	int overrun;
-	ktime_t now;
-	struct pcpu_shared_resources_info* resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, smp_processor_id());
+	struct archmon_probe* probe;
+	int cpu_id, nid;
 
-	for (;;) {
-		now = hrtimer_cb_get_time(timer);
-		overrun = hrtimer_forward(timer, now, resource_info->period);
-		
-		if (!overrun)
-			break;
-		
-		do_archmon_period_timer();
+	g_archmon_info.probes = kcalloc(nr_cpu_ids, sizeof(*g_archmon_info.probes), GFP_KERNEL);
+	if ( !g_archmon_info.probes ) {
+		return -ENOMEM;
 	}
 
-	return HRTIMER_RESTART;
+	for_each_online_cpu(cpu_id) {
+		probe = &g_archmon_info.probes[cpu_id];
+		nid = cpu_to_node(cpu_id);
+
+		probe->len = max_t(size_t, div_u64(2 * g_archmon_info.llc_size, 
+					max(cpumask_weight(cpumask_of_node(nid)), 1U)), PROBE_MIN_BYTES);
+		probe->buf = vmalloc_node(probe->len, nid);
+		if ( !probe->buf ) {
+			printk(KERN_ERR "[%d] cannot allocate a bandwidth probe\n", cpu_id);
+			continue;
+		}
+
+		probe->task = kthread_create_on_node(archmon_probe_thread, probe, nid, "archmon_probe/%d", cpu_id);
+		if ( IS_ERR(probe->task) ) {
+			printk(KERN_ERR "[%d] cannot create a bandwidth probe\n", cpu_id);
+			probe->task = NULL;
+			continue;
+		}
+
+		kthread_bind(probe->task, cpu_id);
+		wake_up_process(probe->task);
+	}
+
+	return 0;
 }
 
+/*
+ *	The miss events exclude the kernel, so they do not see the probes: a
+ *	node's probes also report what they read per second themselves
+ */
+static void archmon_probe_peak(void)
+{
+	struct archmon_probe* probe;
+	u64 now = ktime_get_ns(), start, mbps;
+	int nid, cpu_id;
+
+	if ( !g_archmon_info.probes ) {
+		return;
+	}
+
+	for_each_node(nid) {
+		mbps = 0;
+		for_each_cpu(cpu_id, cpumask_of_node(nid)) {
+			probe = &g_archmon_info.probes[cpu_id];
+			start = READ_ONCE(probe->start);
+			if ( probe->task && start && now > start ) {
+				mbps += div64_u64(READ_ONCE(probe->bytes) * 1000, now - start);
+			}
+		}
+
+		if ( mbps > g_archmon_info.nodes[nid]->peak_mbps ) {
+			WRITE_ONCE(g_archmon_info.nodes[nid]->peak_mbps, mbps);
+		}
+	}
+}
 
-void init_archmon_timer(void* timer_callback)
+/*
+ *	End of a calibration, under calibrate_lock: node budgets become
+ *	calibrate_pct of the measured peak. They are kept in MB/s, so they hold
+ *	whatever the period.
+ */
+static void archmon_calibrate_finish(void)
 {
-	struct pcpu_shared_resources_info* resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, smp_processor_id());
+	struct archmon_node* node;
+	u64 peak, budget;
+	int nid;
+
+	archmon_probe_peak();
+	archmon_probe_stop();
+	WRITE_ONCE(g_archmon_info.calibrating, false);
+
+	for_each_node(nid) {
+		node = g_archmon_info.nodes[nid];
+		if ( !atomic_read(&node->nr_cpus) ) {
+			continue;
+		}
+
+		peak = READ_ONCE(node->peak_mbps);
+		if ( !peak ) {
+			printk(KERN_ERR "node %d: no traffic measured, budget left at %llu MB/s\n", nid, READ_ONCE(node->mbps));
+			continue;
+		}
+
+		budget = div_u64(peak * READ_ONCE(calibrate_pct), 100);
+		if ( budget ) {
+			WRITE_ONCE(node->mbps, budget);
+		}
+		printk(KERN_INFO "node %d: peak %llu MB/s, budget %llu MB/s\n", nid, peak, READ_ONCE(node->mbps));
+	}
 
-	ktime_t interval = resource_info->period;
-	hrtimer_init(&resource_info->period_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
-	resource_info->period_timer.function = timer_callback;	
-	hrtimer_start(&resource_info->period_timer, interval, HRTIMER_MODE_REL_PINNED);
+	archmon_config_changed();
 }
 
-void cleanup_archmon_timer(void* unused)
+static void archmon_calibrate_work(struct work_struct* work)
 {
-	struct pcpu_shared_resources_info* resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, smp_processor_id());
+	mutex_lock(&g_archmon_info.calibrate_lock);
+	if ( g_archmon_info.calibrating ) {
+		archmon_calibrate_finish();
+	}
+	mutex_unlock(&g_archmon_info.calibrate_lock);
+}
 
-	hrtimer_cancel(&resource_info->period_timer);
+/*
+ *	Measure the peak bandwidth of every node for 'ms'. Throttling is off
+ *	meanwhile, the load comes from the probe threads or from userspace.
+ */
+static int archmon_calibrate_start(unsigned int ms)
+{
+	struct archmon_node* node;
+	int nid, ret = 0;
+
+	mutex_lock(&g_archmon_info.calibrate_lock);
+	if ( g_archmon_info.calibrating ) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	for_each_node(nid) {
+		node = g_archmon_info.nodes[nid];
+		node->peak_mbps = 0;
+		atomic64_set(&node->calibrate_sum, 0);
+	}
+
+	if ( READ_ONCE(calibrate_probe) ) {
+		ret = archmon_probe_start();
+		if ( ret ) {
+			goto out;
+		}
+	}
+
+	WRITE_ONCE(g_archmon_info.calibrating, true);
+	schedule_delayed_work(&g_archmon_info.calibrate_work, msecs_to_jiffies(ms));
+	printk(KERN_INFO "calibrating for %u ms\n", ms);
+
+out:
+	mutex_unlock(&g_archmon_info.calibrate_lock);
+	return ret;
 }
 
-int init_archmon_percpu(struct pcpu_shared_resources_info* resource_info, int cpu_id)
+/*
+ *	/sys/kernel/debug/archmon/calibrate: write a duration in ms to start a
+ *	calibration, read the last one's results
+ */
+static int archmon_calibrate_show(struct seq_file* m, void* v)
 {
-	int credit_per_cpu = 0;
+	struct archmon_node* node;
+	u64 us = READ_ONCE(period_us);
+	int nid;
 
-	credit_per_cpu = g_archmon_info.total_credit / num_online_cpus();
-	printk(KERN_INFO "[%d] credit: %d\n", cpu_id, credit_per_cpu);
+	if ( READ_ONCE(g_archmon_info.calibrating) ) {
+		seq_printf(m, "# calibrating\n");
+	}
 
-	resource_info->period = ktime_set(0, TIMER_INTERVAL_US * 1000);	//ns
-	resource_info->l3c_miss_sample_period = credit_per_cpu;
-	resource_info->credit = credit_per_cpu;
-	resource_info->credit_per_period = credit_per_cpu;
-	resource_info->throttled_task = NULL;
-	resource_info->throttled = false;
-		
-	resource_info->perf_l3c_miss_event = reprogram_counter(cpu_id, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, false, true, resource_info->l3c_miss_sample_period, (perf_overflow_handler_t)perf_l3c_miss_overflow);
-	
-	if ( NULL == resource_info->perf_l3c_miss_event ) {
-		printk(KERN_ERR "[%d] cannot initialize PMUs\n", cpu_id);
-		return -1;
+	seq_printf(m, "# node peak_mbps peak_credit budget_mbps budget_credit\n");
+	for_each_node(nid) {
+		node = g_archmon_info.nodes[nid];
+		if ( !atomic_read(&node->nr_cpus) ) {
+			continue;
+		}
+
+		seq_printf(m, "%d %llu %llu %llu %llu\n", nid, READ_ONCE(node->peak_mbps), 
+				archmon_mbps_to_credit(READ_ONCE(node->peak_mbps), us), READ_ONCE(node->mbps), 
+				archmon_node_credit(node, us));
 	}
 
 	return 0;
 }
 
+static int archmon_calibrate_open(struct inode* inode, struct file* file)
+{
+	return single_open(file, archmon_calibrate_show, NULL);
+}
+
+static ssize_t archmon_calibrate_write(struct file* file, const char __user* ubuf, size_t len, loff_t* ppos)
+{
+	unsigned int ms;
+	int ret;
+
+	ret = kstrtouint_from_user(ubuf, len, 0, &ms);
+	if ( ret ) {
+		return ret;
+	}
+
+	if ( !ms ) {
+		return -EINVAL;
+	}
+
+	ret = archmon_calibrate_start(ms);
+	return ret ? ret : len;
+}
+
+static const struct file_operations archmon_calibrate_fops = {
+	.owner = THIS_MODULE,
+	.open = archmon_calibrate_open,
+	.read = seq_read,
+	.write = archmon_calibrate_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 /*
  * Entry point
  */ 
 int init_module(void)
 {
-	int cpu_id = 0;
+	int ret;
+
+	if ( counter_backend < 0 || counter_backend >= ARCHMON_NR_BACKENDS ) {
+		printk(KERN_ERR "unknown counter backend %d\n", counter_backend);
+		return -EINVAL;
+	}
+	g_archmon_info.backend = archmon_backends[counter_backend];
+
+	/* MAX_BANDWIDTH is in LLC misses */
+	if ( count_mode == ARCHMON_COUNT_TRAFFIC && !total_credit_set ) {
+		g_archmon_info.total_credit = (u64)MAX_BANDWIDTH * cache_line_size();
+	}
 
 	g_archmon_info.pcpu_resources_info = alloc_percpu(struct pcpu_shared_resources_info);
-	g_archmon_info.total_credit = MAX_BANDWIDTH;
+	g_archmon_info.hists = alloc_percpu(struct archmon_hists);
+	if ( !g_archmon_info.pcpu_resources_info || !g_archmon_info.hists ) {
+		printk(KERN_ERR "cannot allocate per-cpu state\n");
+		ret = -ENOMEM;
+		goto out_percpu;
+	}
 
-	for_each_online_cpu(cpu_id) {
-		struct pcpu_shared_resources_info* resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, cpu_id);
-		if ( init_archmon_percpu(resource_info, cpu_id) == -1 ) {
-			return -1;
-		}
+	g_archmon_info.debugfs_dir = debugfs_create_dir("archmon", NULL);
+	debugfs_create_file("groups", 0644, g_archmon_info.debugfs_dir, NULL, &archmon_groups_fops);
+	debugfs_create_file("exempt", 0644, g_archmon_info.debugfs_dir, NULL, &archmon_exempt_fops);
+	debugfs_create_file("histograms", 0444, g_archmon_info.debugfs_dir, NULL, &archmon_hists_fops);
+
+	ret = archmon_nodes_init();
+	if ( ret ) {
+		printk(KERN_ERR "cannot allocate node budgets\n");
+		goto out_debugfs;
+	}
+
+	/* The ioctls reach into the nodes */
+	ret = archmon_telemetry_init();
+	if ( ret ) {
+		printk(KERN_ERR "cannot initialize telemetry\n");
+		goto out_debugfs;
+	}
+
+	archmon_imc_init();
+	debugfs_create_file("dram", 0444, g_archmon_info.debugfs_dir, NULL, &archmon_dram_fops);
+
+#ifdef CONFIG_X86
+	if ( !llc_kb && boot_cpu_data.x86_cache_size > 0 ) {
+		llc_kb = boot_cpu_data.x86_cache_size;
+	}
+#endif
+	if ( !llc_kb ) {
+		printk(KERN_INFO "unknown LLC size, assuming %d KB\n", DEFAULT_LLC_KB);
+		llc_kb = DEFAULT_LLC_KB;
+	}
+	g_archmon_info.llc_size = (u64)llc_kb * 1024;
+
+	/* Sets up every online CPU now, and CPUs that come online later */
+	g_archmon_info.hp_state = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "archmon:online", archmon_cpu_online, archmon_cpu_offline);
+	if ( g_archmon_info.hp_state < 0 ) {
+		printk(KERN_ERR "cannot register cpu hotplug callbacks\n");
+		ret = g_archmon_info.hp_state;
+		goto out_imc;
+	}
+
+	INIT_DELAYED_WORK(&g_archmon_info.calibrate_work, archmon_calibrate_work);
+	debugfs_create_file("calibrate", 0644, g_archmon_info.debugfs_dir, NULL, &archmon_calibrate_fops);
+	if ( calibrate_ms && archmon_calibrate_start(calibrate_ms) ) {
+		printk(KERN_ERR "cannot start the calibration, keeping the configured budgets\n");
 	}
-	
-	on_each_cpu(init_archmon_timer, archmon_period_timer, 1);
 	
 	printk(KERN_INFO "Archmon is loaded\n");
 
 	return 0;    // Non-zero return means that the module couldn't be loaded.
+
+out_imc:
+	archmon_imc_release_all();
+	archmon_telemetry_release();
+out_debugfs:
+	debugfs_remove_recursive(g_archmon_info.debugfs_dir);
+	archmon_nodes_release();
+out_percpu:
+	free_percpu(g_archmon_info.hists);
+	free_percpu(g_archmon_info.pcpu_resources_info);
+	return ret;
 }
 
 void cleanup_module(void)
 {
-	int i = 0;
+	struct archmon_group *group, *tmp;
+	u64 overflow_count, overflow_ns, overflow_max_ns;
+	int cpu_id, i;
+
+	/*
+	 * The files go first, so that nothing can start a calibration or reach
+	 * into what is freed below. With hotplug held off, the per-CPU
+	 * directories go along and CPUs onlined later get none.
+	 */
+	cpus_read_lock();
+	debugfs_remove_recursive(g_archmon_info.debugfs_dir);
+	g_archmon_info.debugfs_dir = NULL;
+	for_each_possible_cpu(cpu_id) {
+		per_cpu_ptr(g_archmon_info.pcpu_resources_info, cpu_id)->debugfs_dir = NULL;
+	}
+	cpus_read_unlock();
+
+	/* A calibration in progress leaves the budgets alone */
+	cancel_delayed_work_sync(&g_archmon_info.calibrate_work);
+	mutex_lock(&g_archmon_info.calibrate_lock);
+	archmon_probe_stop();
+	mutex_unlock(&g_archmon_info.calibrate_lock);
 
-	for_each_online_cpu(i) {
+	/* Tears down every online CPU */
+	cpuhp_remove_state(g_archmon_info.hp_state);
 
-		struct pcpu_shared_resources_info* resource_info = per_cpu_ptr(g_archmon_info.pcpu_resources_info, i);
-		stop_counter(resource_info->perf_l3c_miss_event);
+	mutex_lock(&g_archmon_info.group_lock);
+	list_for_each_entry_safe(group, tmp, &g_archmon_info.group_list, list) {
+		archmon_group_del(group);
+	}
+	for ( i = 0; i < ARCHMON_MAX_EXEMPT; i++ ) {
+		if ( rcu_access_pointer(g_archmon_info.exempt[i]) ) {
+			archmon_exempt_del(i);
+		}
 	}
+	mutex_unlock(&g_archmon_info.group_lock);
 
-	on_each_cpu(cleanup_archmon_timer, NULL, 1);
+	archmon_telemetry_release();
+	archmon_nodes_release();
+	archmon_imc_release_all();
+
+	free_percpu(g_archmon_info.hists);
+	free_percpu(g_archmon_info.pcpu_resources_info);
+
+	overflow_count = atomic64_read(&g_archmon_info.overflow_count);
+	overflow_ns = atomic64_read(&g_archmon_info.overflow_ns);
+	overflow_max_ns = atomic64_read(&g_archmon_info.overflow_max_ns);
+
+	if ( overflow_count ) {
+		printk(KERN_INFO "overflow handler: %llu calls, avg %llu ns, max %llu ns\n", 
+				overflow_count, div64_u64(overflow_ns, overflow_count), overflow_max_ns);
+	}
 
 	printk(KERN_INFO "Archmon is unloaded\n");
 }
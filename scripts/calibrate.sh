@@ -0,0 +1,77 @@
+#!/bin/bash
+#
+# calibrate.sh
+#
+# Measures the peak bandwidth of every node and sets the node budgets to
+# calibrate_pct (module parameter) of it. The load comes from the module's
+# own probe threads, or with -u from util/archbench read streams on every
+# CPU of every node.
+
+# Permission check
+if [ $(id -u) != 0 ]
+then
+  echo "Root permission is required to run this script!"
+  exit 1
+fi
+
+usage()
+{
+	echo "usage: $0 [-u] [duration in ms]"
+	echo "-u: generate the load with util/archbench"
+	exit 1
+}
+
+userspace=0
+if [ "$1" == "-u" ]
+then
+	userspace=1
+	shift
+fi
+
+if [ $# -gt 1 ]
+then
+	usage
+fi
+
+ms=${1:-2000}
+archmon=/sys/kernel/debug/archmon
+params=/sys/module/resource_monitor/parameters
+archbench=$(dirname $0)/../util/archbench/archbench
+
+if [ ! -d $archmon ]
+then
+	echo "archmon is not loaded"
+	exit 1
+fi
+
+if [ $userspace == 1 ] && [ ! -x $archbench ]
+then
+	echo "build $archbench first"
+	exit 1
+fi
+
+echo $((1 - userspace)) > $params/calibrate_probe
+echo $ms > $archmon/calibrate || exit 1
+
+if [ $userspace == 1 ]
+then
+	for node in /sys/devices/system/node/node[0-9]*
+	do
+		cpus=$(cat $node/cpulist)
+		[ -n "$cpus" ] || continue
+
+		nr=$(echo $cpus | tr ',' '\n' | awk -F- '{ n += ($2 == "" ? 1 : $2 - $1 + 1) } END { print n }')
+		$archbench -m read -t $nr -c $cpus -n ${node##*node} -s 16 -d $(echo "$ms / 1000 + 1" | bc -l) > /dev/null &
+	done
+	wait
+else
+	sleep $(echo "$ms / 1000 + 0.5" | bc -l)
+fi
+
+while grep -q calibrating $archmon/calibrate
+do
+	sleep 0.1
+done
+
+echo 1 > $params/calibrate_probe
+cat $archmon/calibrate
@@ -0,0 +1,84 @@
+#!/bin/bash
+#
+# resctrl-occupancy.sh
+#
+# Feeds the LLC occupancy measured by CMT (resctrl) to archmon, which uses
+# it instead of its own estimate. One monitoring group per CPU.
+
+# Permission check
+if [ $(id -u) != 0 ]
+then
+  echo "Root permission is required to run this script!"
+  exit 1
+fi
+
+usage()
+{
+	echo "usage: $0 [interval in seconds]"
+	exit 1
+}
+
+if [ $# -gt 1 ]
+then
+	usage
+fi
+
+interval=${1:-1}
+resctrl=/sys/fs/resctrl
+archmon=/sys/kernel/debug/archmon
+
+if [ ! -d $archmon ]
+then
+	echo "archmon is not loaded"
+	exit 1
+fi
+
+# check resctrl
+if [ ! -d $resctrl/info ]
+then
+	echo "mount resctrl"
+	mount -t resctrl resctrl $resctrl || exit 1
+fi
+
+if [ ! -f $resctrl/info/L3_MON/mon_features ] || ! grep -q llc_occupancy $resctrl/info/L3_MON/mon_features
+then
+	echo "LLC occupancy monitoring is not supported"
+	exit 1
+fi
+
+cpus=$(ls -d $archmon/cpu* | sed 's/.*cpu//')
+
+cleanup()
+{
+	for cpu in $cpus
+	do
+		rmdir $resctrl/mon_groups/archmon_cpu$cpu 2> /dev/null
+	done
+	exit 0
+}
+trap cleanup INT TERM
+
+# Tasks not in a monitoring group are counted to the group of the CPU they run on
+for cpu in $cpus
+do
+	mkdir -p $resctrl/mon_groups/archmon_cpu$cpu
+	echo $cpu > $resctrl/mon_groups/archmon_cpu$cpu/cpus_list
+done
+
+while true
+do
+	for cpu in $cpus
+	do
+		[ -d $archmon/cpu$cpu ] || continue
+
+		# Only the L3 domain of the CPU has a non-zero value
+		bytes=0
+		for occupancy in $resctrl/mon_groups/archmon_cpu$cpu/mon_data/mon_L3_*/llc_occupancy
+		do
+			bytes=$((bytes + $(cat $occupancy)))
+		done
+
+		echo $((bytes / 1024)) > $archmon/cpu$cpu/llc_occupancy
+	done
+	sleep $interval
+done
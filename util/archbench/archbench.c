@@ -0,0 +1,446 @@
+/*
+ * archbench: memory bandwidth and latency benchmark
+ *
+ * Checks that the budgets configured in the module produce the bandwidth
+ * and latency they should. Each thread is pinned before it allocates and
+ * touches its own arrays, so memory is local to its CPU unless a NUMA node
+ * is given.
+ *
+ * Modes:
+ *	copy, scale, add, triad	STREAM kernels
+ *	read			read-only stream
+ *	ntwrite			non-temporal write stream (plain stores without SSE2)
+ *	chase			dependent loads over a random cycle, latency
+ *	loaded			chase on the first thread, read streams on the others
+ *
+ * Prints CSV: one line per thread and a total.
+ *
+ * Author: Jeongseob Ahn (ahnjeong@umich.edu)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MAX_THREADS	256
+#define LINE_SIZE	64
+#define CHASE_BATCH	(1 << 20)	/* loads between clock reads */
+
+#ifndef MPOL_BIND
+#define MPOL_BIND	2
+#endif
+
+enum mode {
+	MODE_COPY = 0,
+	MODE_SCALE,
+	MODE_ADD,
+	MODE_TRIAD,
+	MODE_READ,
+	MODE_NTWRITE,
+	MODE_CHASE,
+	MODE_LOADED,
+};
+
+static const char *mode_names[] = { "copy", "scale", "add", "triad", "read", "ntwrite", "chase", "loaded" };
+
+/* Bytes moved per element, as STREAM counts them */
+static const int mode_bytes[] = { 16, 16, 24, 24, 8, 8, 0, 0 };
+
+struct worker {
+	pthread_t	thread;
+	int		id;
+	int		cpu;		/* -1: not pinned */
+	enum mode	mode;
+
+	double		*a, *b, *c;
+	void		**chain;
+	size_t		len;		/* bytes of each array */
+
+	/* Results */
+	uint64_t	bytes;
+	uint64_t	loads;
+	double		seconds;
+	int		error;
+};
+
+static struct worker workers[MAX_THREADS];
+static int nr_workers = 1;
+static enum mode mode = MODE_TRIAD;
+static size_t size = 256UL << 20;
+static double duration = 5;
+static int node = -1;
+
+static pthread_barrier_t start_barrier;
+static volatile int stop;
+static volatile double sink;
+
+static void usage(FILE* out)
+{
+	fprintf(out, "Usage: ./archbench [options]\n\n");
+	fprintf(out, "Options:\n"
+		" -m, mode: copy, scale, add, triad (default), read, ntwrite, chase, loaded\n"
+		" -t, number of threads (default: 1)\n"
+		" -c, CPUs to pin the threads to, e.g. 0,2,4-7 (default: not pinned)\n"
+		" -n, NUMA node to allocate from (default: local)\n"
+		" -s, MB per array and thread (default: 256)\n"
+		" -d, duration in seconds (default: 5)\n\n");
+
+	exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *	"0,2,4-7" to the CPUs of the threads, in order
+ */
+static int parse_cpus(const char *list)
+{
+	const char *p = list;
+	char *end;
+	int first, last, nr = 0;
+
+	while ( *p ) {
+		first = last = strtol(p, &end, 10);
+		if ( end == p ) {
+			return -1;
+		}
+		if ( *end == '-' ) {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if ( end == p || last < first ) {
+				return -1;
+			}
+		}
+
+		for ( ; first <= last && nr < MAX_THREADS; first++ ) {
+			workers[nr++].cpu = first;
+		}
+
+		p = *end == ',' ? end + 1 : end;
+		if ( *end && *end != ',' ) {
+			return -1;
+		}
+	}
+
+	return nr;
+}
+
+static void *alloc_array(size_t len)
+{
+	void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	unsigned long mask;
+
+	if ( addr == MAP_FAILED ) {
+		return NULL;
+	}
+
+	/* No libnuma dependency, only the syscall */
+	if ( node >= 0 ) {
+		mask = 1UL << node;
+		if ( syscall(SYS_mbind, addr, len, MPOL_BIND, &mask, sizeof(mask) * 8, 0) ) {
+			perror("mbind");
+			munmap(addr, len);
+			return NULL;
+		}
+	}
+
+	return addr;
+}
+
+/*
+ *	A single random cycle through all the lines of the buffer (Sattolo),
+ *	so that no prefetcher can guess the next load
+ */
+static void build_chain(struct worker *w)
+{
+	size_t nr = w->len / LINE_SIZE, i, j;
+	size_t *order = malloc(nr * sizeof(*order));
+	uint64_t seed = 88172645463325252ULL + w->id;
+
+	if ( !order ) {
+		w->error = ENOMEM;
+		return;
+	}
+
+	for ( i = 0; i < nr; i++ ) {
+		order[i] = i;
+	}
+
+	for ( i = nr - 1; i > 0; i-- ) {
+		size_t tmp;
+
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		j = seed % i;
+
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	for ( i = 0; i < nr; i++ ) {
+		w->chain[order[i] * (LINE_SIZE / sizeof(void *))] =
+			&w->chain[order[(i + 1) % nr] * (LINE_SIZE / sizeof(void *))];
+	}
+
+	free(order);
+}
+
+static int setup(struct worker *w)
+{
+	size_t i, nr = w->len / sizeof(double);
+
+	if ( w->mode == MODE_CHASE ) {
+		w->chain = alloc_array(w->len);
+		if ( !w->chain ) {
+			return ENOMEM;
+		}
+		build_chain(w);
+		return w->error;
+	}
+
+	w->a = alloc_array(w->len);
+	w->b = alloc_array(w->len);
+	w->c = alloc_array(w->len);
+	if ( !w->a || !w->b || !w->c ) {
+		return ENOMEM;
+	}
+
+	/* First touch, from the pinned thread */
+	for ( i = 0; i < nr; i++ ) {
+		w->a[i] = 1.0;
+		w->b[i] = 2.0;
+		w->c[i] = 0.0;
+	}
+
+	return 0;
+}
+
+static void run_pass(struct worker *w)
+{
+	double *a = w->a, *b = w->b, *c = w->c, scalar = 3.0, sum = 0;
+	size_t i, nr = w->len / sizeof(double);
+
+	switch ( w->mode ) {
+	case MODE_COPY:
+		for ( i = 0; i < nr; i++ )
+			c[i] = a[i];
+		break;
+	case MODE_SCALE:
+		for ( i = 0; i < nr; i++ )
+			b[i] = scalar * c[i];
+		break;
+	case MODE_ADD:
+		for ( i = 0; i < nr; i++ )
+			c[i] = a[i] + b[i];
+		break;
+	case MODE_TRIAD:
+		for ( i = 0; i < nr; i++ )
+			a[i] = b[i] + scalar * c[i];
+		break;
+	case MODE_READ:
+		for ( i = 0; i < nr; i++ )
+			sum += a[i];
+		sink = sum;
+		break;
+	case MODE_NTWRITE:
+#ifdef __SSE2__
+		for ( i = 0; i + 2 <= nr; i += 2 )
+			_mm_stream_pd(&a[i], _mm_set1_pd(scalar));
+		_mm_sfence();
+#else
+		for ( i = 0; i < nr; i++ )
+			a[i] = scalar;
+#endif
+		break;
+	default:
+		break;
+	}
+
+	w->bytes += (uint64_t)nr * mode_bytes[w->mode];
+}
+
+static void run_chase(struct worker *w)
+{
+	void **p = w->chain;
+	int i;
+
+	while ( !stop ) {
+		for ( i = 0; i < CHASE_BATCH; i++ ) {
+			p = *p;
+		}
+		w->loads += CHASE_BATCH;
+	}
+
+	sink = (double)(uintptr_t)p;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	cpu_set_t set;
+	double start;
+
+	if ( w->cpu >= 0 ) {
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		w->error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	if ( !w->error ) {
+		w->error = setup(w);
+	}
+
+	/* Everybody starts together, errors are reported after the run */
+	pthread_barrier_wait(&start_barrier);
+	if ( w->error ) {
+		return NULL;
+	}
+
+	start = now();
+	if ( w->mode == MODE_CHASE ) {
+		run_chase(w);
+	} else {
+		while ( !stop ) {
+			run_pass(w);
+		}
+	}
+	w->seconds = now() - start;
+
+	return NULL;
+}
+
+static void print_result(const char *thread, int cpu, uint64_t bytes, double seconds, uint64_t loads, double chase_seconds)
+{
+	printf("%s,%s,%d,%d,%zu,%llu,%.3f,%.1f,%.1f\n", mode_names[mode], thread, cpu, node, size >> 20,
+			(unsigned long long)bytes, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0.0,
+			loads ? chase_seconds * 1e9 / loads : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t total_bytes = 0, total_loads = 0;
+	double total_seconds = 0, chase_seconds = 0;
+	char name[16];
+	int c, i, nr_cpus = 0, failed = 0;
+
+	for ( i = 0; i < MAX_THREADS; i++ ) {
+		workers[i].cpu = -1;
+	}
+
+	while ((c = getopt(argc, argv, "m:t:c:n:s:d:h")) != -1) {
+		switch (c) {
+		case 'm':
+			for ( i = 0; i <= MODE_LOADED; i++ ) {
+				if ( !strcmp(optarg, mode_names[i]) ) {
+					break;
+				}
+			}
+			if ( i > MODE_LOADED ) {
+				usage(stderr);
+			}
+			mode = i;
+			break;
+		case 't':
+			nr_workers = atoi(optarg);
+			break;
+		case 'c':
+			nr_cpus = parse_cpus(optarg);
+			if ( nr_cpus <= 0 ) {
+				usage(stderr);
+			}
+			break;
+		case 'n':
+			node = atoi(optarg);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'h':
+			usage(stdout);
+			break;
+		default:
+			usage(stderr);
+			break;
+		}
+	}
+
+	if ( nr_workers < 1 || nr_workers > MAX_THREADS || (nr_cpus && nr_cpus < nr_workers) ||
+			size < LINE_SIZE || duration <= 0 || node >= (int)(sizeof(unsigned long) * 8) ) {
+		usage(stderr);
+	}
+
+	for ( i = 0; i < nr_workers; i++ ) {
+		workers[i].id = i;
+		workers[i].len = size;
+		workers[i].mode = mode;
+
+		/* Loaded latency: the first thread measures, the others load */
+		if ( mode == MODE_LOADED ) {
+			workers[i].mode = i ? MODE_READ : MODE_CHASE;
+		}
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, nr_workers + 1);
+	for ( i = 0; i < nr_workers; i++ ) {
+		if ( pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) ) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	usleep(duration * 1e6);
+	stop = 1;
+
+	printf("mode,thread,cpu,node,array_mb,bytes,seconds,mbps,latency_ns\n");
+	for ( i = 0; i < nr_workers; i++ ) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		if ( w->error ) {
+			fprintf(stderr, "thread %d: %s\n", i, strerror(w->error));
+			failed = 1;
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "%d", i);
+		print_result(name, w->cpu, w->bytes, w->seconds, w->loads, w->seconds);
+
+		total_bytes += w->bytes;
+		total_loads += w->loads;
+		if ( w->seconds > total_seconds ) {
+			total_seconds = w->seconds;
+		}
+		if ( w->loads ) {
+			chase_seconds = w->seconds;
+		}
+	}
+
+	if ( nr_workers > 1 ) {
+		print_result("total", -1, total_bytes, total_seconds, total_loads, chase_seconds);
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
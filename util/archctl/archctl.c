@@ -0,0 +1,530 @@
+/*
+ * archctl: closed-loop controller retuning archmon budgets from telemetry
+ *
+ * Every round it drains the telemetry rings of /dev/archmon (no syscall),
+ * reads the group counters (one ioctl) and pushes all new budgets at once
+ * (one ioctl). Two loops, either or both:
+ *
+ *	-b/-B	PI controller keeping the total bandwidth at a target. The
+ *		budget is split over the CPUs by demand, throttled CPUs
+ *		counting for what they would have used unthrottled.
+ *
+ *	-L	AIMD on the budget of best-effort groups (-g) keeping a
+ *		latency signal under a target, e.g. the p99 a service exports
+ *		to a file. Halved while the latency is over the target, grown
+ *		by 1/16 of the maximum per round otherwise.
+ *
+ * When it exits, CPUs go back to their default share and groups to the
+ * budget they had when it started.
+ *
+ * Author: Jeongseob Ahn (ahnjeong@umich.edu)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "archmon.h"
+
+#define MAX_CPUS		ARCHMON_MAX_BATCH
+#define MAX_GROUPS		64
+#define CALIBRATE_PATH		"/sys/kernel/debug/archmon/calibrate"
+#define POSSIBLE_PATH		"/sys/devices/system/cpu/possible"
+
+#define PI_KP			0.5
+#define PI_KI			0.2	/* per second */
+#define AIMD_DECREASE		0.5
+#define AIMD_INCREASE_SHIFT	4
+
+struct cpu_stat {
+	/* Windows that ended in the last round */
+	double		used;		/* credit */
+	double		throttle_ns;
+	double		covered_ns;	/* time they span */
+	double		mbps;		/* over the last windows that ended */
+
+	/* The last record, its window ends where the next one starts */
+	struct archmon_record last;
+	int		has_last;
+};
+
+struct controller {
+	/* Total bandwidth, PI */
+	double		target_mbps;	/* 0: off */
+	double		budget_mbps;	/* all CPUs together */
+	double		integral;
+
+	/* Latency, AIMD */
+	const char	*latency_path;	/* NULL: off */
+	int		latency_fd;
+	double		latency_target;
+	double		group_mbps;
+	const char	*groups[MAX_GROUPS];
+	int		nr_groups;
+
+	double		min_mbps;	/* per budget */
+	double		max_mbps;	/* per budget */
+	unsigned int	unit;		/* bytes per credit */
+	int		verbose;
+};
+
+static struct controller ctl = {
+	.latency_fd = -1,
+	.min_mbps = 100,
+	.max_mbps = 100000,
+	.unit = 64,
+};
+
+static void *telemetry;
+static int nr_cpus;
+static struct cpu_stat cpu_stats[MAX_CPUS];
+static double demand[MAX_CPUS];
+static struct archmon_budget budgets[MAX_CPUS + MAX_GROUPS];
+static struct archmon_group_stat group_stats[MAX_GROUPS];
+static struct archmon_budget saved_groups[MAX_GROUPS];
+static int nr_saved_groups;
+static volatile sig_atomic_t done;
+
+static void usage(FILE* out)
+{
+	fprintf(out, "Usage: ./archctl [options]\n\n");
+	fprintf(out, "Options:\n"
+		" -b, total bandwidth target in MB/s\n"
+		" -B, total bandwidth target in %% of the calibrated peak\n"
+		" -L, file:target, latency signal to keep under target\n"
+		" -g, best-effort group (cgroup path as in debugfs groups), repeatable\n"
+		" -i, control interval in ms (default: 10)\n"
+		" -m, minimum budget in MB/s (default: 100)\n"
+		" -M, maximum budget in MB/s (default: 100000)\n"
+		" -u, bytes per credit, 1 in traffic mode (default: 64)\n"
+		" -v, print every round as CSV, and the daemon's CPU time at exit\n\n");
+
+	exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void on_signal(int sig)
+{
+	done = 1;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ *	The kernel maps a ring per possible CPU
+ */
+static int possible_cpus(void)
+{
+	FILE *fp = fopen(POSSIBLE_PATH, "r");
+	int first, last = 0;
+
+	if ( !fp ) {
+		return -1;
+	}
+
+	if ( fscanf(fp, "%d-%d", &first, &last) < 1 ) {
+		last = -1;
+	} else if ( last < first ) {
+		last = first;
+	}
+	fclose(fp);
+
+	return last + 1;
+}
+
+/*
+ *	Sum of the peaks measured by the last calibration
+ */
+static double calibrated_peak(void)
+{
+	FILE *fp = fopen(CALIBRATE_PATH, "r");
+	char line[256];
+	unsigned long long peak;
+	double total = 0;
+	int nid;
+
+	if ( !fp ) {
+		return 0;
+	}
+
+	while ( fgets(line, sizeof(line), fp) ) {
+		if ( line[0] != '#' && sscanf(line, "%d %llu", &nid, &peak) == 2 ) {
+			total += peak;
+		}
+	}
+	fclose(fp);
+
+	return total;
+}
+
+/*
+ *	Drain the rings, see archmon.h for the protocol. Records come once per
+ *	(adaptive) period, not per round, and are stamped with the start of
+ *	their period: a window is only accounted for once the next record
+ *	tells where it ended. Returns the number of CPUs with windows that
+ *	ended.
+ */
+static int read_telemetry(void)
+{
+	int cpu, nr = 0;
+
+	for ( cpu = 0; cpu < nr_cpus; cpu++ ) {
+		struct archmon_ring *ring = telemetry + (size_t)cpu * ARCHMON_RING_BYTES;
+		struct cpu_stat *stat = &cpu_stats[cpu];
+		__u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		__u64 tail = ring->tail;
+
+		stat->used = stat->throttle_ns = stat->covered_ns = 0;
+
+		for ( ; tail != head; tail++ ) {
+			struct archmon_record *record = &ring->records[tail & (ring->size - 1)];
+
+			if ( stat->has_last ) {
+				stat->used += stat->last.used;
+				stat->throttle_ns += stat->last.throttle_ns;
+				stat->covered_ns += record->timestamp - stat->last.timestamp;
+			}
+			stat->last = *record;
+			stat->has_last = 1;
+		}
+
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+		if ( stat->covered_ns > 0 ) {
+			nr++;
+		}
+	}
+
+	return nr;
+}
+
+static int set_budgets(int fd, int nr)
+{
+	struct archmon_batch batch = { .nr = nr, .ptr = (__u64)(unsigned long)budgets };
+
+	return nr ? ioctl(fd, ARCHMON_IOC_SET_BUDGETS, &batch) : 0;
+}
+
+static int get_groups(int fd)
+{
+	struct archmon_batch batch = { .nr = MAX_GROUPS, .ptr = (__u64)(unsigned long)group_stats };
+	int nr = ioctl(fd, ARCHMON_IOC_GET_GROUPS, &batch);
+
+	return nr > MAX_GROUPS ? MAX_GROUPS : nr;
+}
+
+static double clamp(double value, double min, double max)
+{
+	return value < min ? min : (value > max ? max : value);
+}
+
+/*
+ *	PI on the total budget. The integral is clamped to what the budget can
+ *	take, so it does not wind up while the demand stays below the target.
+ */
+static int control_bandwidth(double mbps, double dt)
+{
+	double error = ctl.target_mbps - mbps, weight, total_weight = 0;
+	double max_total = ctl.max_mbps * nr_cpus, min_total = ctl.min_mbps * nr_cpus;
+	int cpu;
+
+	ctl.integral = clamp(ctl.integral + PI_KI * error * dt, min_total - ctl.target_mbps, max_total - ctl.target_mbps);
+	ctl.budget_mbps = clamp(ctl.target_mbps + PI_KP * error + ctl.integral, min_total, max_total);
+
+	for ( cpu = 0; cpu < nr_cpus; cpu++ ) {
+		struct cpu_stat *stat = &cpu_stats[cpu];
+
+		/* What it would have used per ns unthrottled, as of its last windows */
+		if ( stat->covered_ns > 0 ) {
+			demand[cpu] = stat->used / (stat->covered_ns > stat->throttle_ns ? 
+					stat->covered_ns - stat->throttle_ns : stat->covered_ns);
+		}
+		total_weight += demand[cpu];
+	}
+
+	for ( cpu = 0; cpu < nr_cpus; cpu++ ) {
+		weight = total_weight > 0 ? demand[cpu] / total_weight : 1.0 / nr_cpus;
+
+		budgets[cpu].target = ARCHMON_TARGET_CPU;
+		budgets[cpu].id = cpu;
+		budgets[cpu].mbps = clamp(ctl.budget_mbps * weight, ctl.min_mbps, ctl.max_mbps);
+	}
+
+	return nr_cpus;
+}
+
+static double read_latency(void)
+{
+	char buf[64];
+	ssize_t len = pread(ctl.latency_fd, buf, sizeof(buf) - 1, 0);
+
+	if ( len <= 0 ) {
+		return -1;
+	}
+	buf[len] = '\0';
+
+	return atof(buf);
+}
+
+static int control_latency_group(const struct archmon_group_stat *stat)
+{
+	int i;
+
+	for ( i = 0; i < ctl.nr_groups; i++ ) {
+		if ( !strcmp(stat->path, ctl.groups[i]) ) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int control_latency(double latency, int nr_stats, struct archmon_budget *out)
+{
+	int i, nr = 0;
+
+	if ( latency < 0 ) {
+		return 0;
+	}
+
+	if ( latency > ctl.latency_target ) {
+		ctl.group_mbps *= AIMD_DECREASE;
+	} else {
+		ctl.group_mbps += ctl.max_mbps / (1 << AIMD_INCREASE_SHIFT);
+	}
+	ctl.group_mbps = clamp(ctl.group_mbps, ctl.min_mbps, ctl.max_mbps);
+
+	for ( i = 0; i < nr_stats; i++ ) {
+		if ( control_latency_group(&group_stats[i]) ) {
+			out[nr].target = ARCHMON_TARGET_GROUP;
+			out[nr].id = group_stats[i].slot;
+			out[nr].mbps = ctl.group_mbps;
+			nr++;
+		}
+	}
+
+	return nr;
+}
+
+/*
+ *	Budgets of the best-effort groups before the daemon took over. Groups
+ *	set in credit rather than MB/s cannot be restored.
+ */
+static void save_groups(int fd)
+{
+	int i, nr_stats = get_groups(fd);
+
+	for ( i = 0; i < nr_stats; i++ ) {
+		if ( group_stats[i].mbps && control_latency_group(&group_stats[i]) ) {
+			saved_groups[nr_saved_groups].target = ARCHMON_TARGET_GROUP;
+			saved_groups[nr_saved_groups].id = group_stats[i].slot;
+			saved_groups[nr_saved_groups].mbps = group_stats[i].mbps;
+			nr_saved_groups++;
+		}
+	}
+}
+
+static void reset_budgets(int fd)
+{
+	int cpu, nr = 0;
+
+	if ( ctl.target_mbps ) {
+		for ( cpu = 0; cpu < nr_cpus; cpu++ ) {
+			budgets[nr].target = ARCHMON_TARGET_CPU;
+			budgets[nr].id = cpu;
+			budgets[nr].mbps = 0;
+			nr++;
+		}
+	}
+
+	memcpy(&budgets[nr], saved_groups, nr_saved_groups * sizeof(saved_groups[0]));
+	nr += nr_saved_groups;
+
+	if ( set_budgets(fd, nr) ) {
+		perror("cannot reset the budgets");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	double interval = 0.01, target_pct = 0, last, t, mbps = 0, latency = -1;
+	struct timespec sleep_ts;
+	struct rusage usage_info;
+	char *sep;
+	int c, fd, cpu, nr, nr_stats = 0, rounds = 0;
+
+	while ((c = getopt(argc, argv, "b:B:L:g:i:m:M:u:vh")) != -1) {
+		switch (c) {
+		case 'b':
+			ctl.target_mbps = atof(optarg);
+			break;
+		case 'B':
+			target_pct = atof(optarg);
+			break;
+		case 'L':
+			sep = strrchr(optarg, ':');
+			if ( !sep ) {
+				usage(stderr);
+			}
+			*sep = '\0';
+			ctl.latency_path = optarg;
+			ctl.latency_target = atof(sep + 1);
+			break;
+		case 'g':
+			if ( ctl.nr_groups == MAX_GROUPS ) {
+				usage(stderr);
+			}
+			ctl.groups[ctl.nr_groups++] = optarg;
+			break;
+		case 'i':
+			interval = atof(optarg) / 1000;
+			break;
+		case 'm':
+			ctl.min_mbps = atof(optarg);
+			break;
+		case 'M':
+			ctl.max_mbps = atof(optarg);
+			break;
+		case 'u':
+			ctl.unit = atoi(optarg);
+			break;
+		case 'v':
+			ctl.verbose = 1;
+			break;
+		case 'h':
+			usage(stdout);
+			break;
+		default:
+			usage(stderr);
+			break;
+		}
+	}
+
+	if ( target_pct > 0 ) {
+		ctl.target_mbps = calibrated_peak() * target_pct / 100;
+		if ( !ctl.target_mbps ) {
+			fprintf(stderr, "no calibrated peak, see debugfs archmon/calibrate\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if ( (!ctl.target_mbps && !ctl.latency_path) || (ctl.latency_path && !ctl.nr_groups) ||
+			interval <= 0 || ctl.unit < 1 || ctl.min_mbps < 1 || ctl.max_mbps < ctl.min_mbps ) {
+		usage(stderr);
+	}
+
+	nr_cpus = possible_cpus();
+	if ( nr_cpus <= 0 || nr_cpus > MAX_CPUS ) {
+		fprintf(stderr, "cannot handle %d CPUs\n", nr_cpus);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(ARCHMON_DEV, O_RDWR);
+	if ( fd < 0 ) {
+		perror(ARCHMON_DEV);
+		return EXIT_FAILURE;
+	}
+
+	telemetry = mmap(NULL, (size_t)nr_cpus * ARCHMON_RING_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if ( telemetry == MAP_FAILED ) {
+		perror("mmap");
+		return EXIT_FAILURE;
+	}
+
+	if ( ctl.latency_path ) {
+		ctl.latency_fd = open(ctl.latency_path, O_RDONLY);
+		if ( ctl.latency_fd < 0 ) {
+			perror(ctl.latency_path);
+			return EXIT_FAILURE;
+		}
+		ctl.group_mbps = ctl.max_mbps;
+		save_groups(fd);
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	/* Start from what is there, not from whatever piled up before */
+	read_telemetry();
+	ctl.budget_mbps = ctl.target_mbps;
+	last = now();
+
+	sleep_ts.tv_sec = (time_t)interval;
+	sleep_ts.tv_nsec = (long)((interval - sleep_ts.tv_sec) * 1e9);
+
+	if ( ctl.verbose ) {
+		printf("time,mbps,budget_mbps,latency,group_mbps\n");
+	}
+
+	while ( !done ) {
+		nanosleep(&sleep_ts, NULL);
+		t = now();
+
+		/*
+		 * Each CPU's rate over the time its records cover, not over the
+		 * round: a CPU in the middle of a long window keeps the rate of
+		 * its last one. Rounds that see no window end at all leave the
+		 * PI loop alone.
+		 */
+		nr = 0;
+		if ( read_telemetry() ) {
+			mbps = 0;
+			for ( cpu = 0; cpu < nr_cpus; cpu++ ) {
+				struct cpu_stat *stat = &cpu_stats[cpu];
+
+				if ( stat->covered_ns > 0 ) {
+					stat->mbps = stat->used * ctl.unit * 1e3 / stat->covered_ns;
+				}
+				mbps += stat->mbps;
+			}
+
+			if ( ctl.target_mbps ) {
+				nr = control_bandwidth(mbps, t - last);
+			}
+			last = t;
+		}
+
+		if ( ctl.latency_path ) {
+			nr_stats = get_groups(fd);
+			latency = read_latency();
+			if ( nr_stats > 0 ) {
+				nr += control_latency(latency, nr_stats, &budgets[nr]);
+			}
+		}
+
+		if ( set_budgets(fd, nr) ) {
+			perror("cannot set budgets");
+		}
+
+		if ( ctl.verbose ) {
+			printf("%.3f,%.1f,%.1f,%.3f,%.1f\n", t, mbps, ctl.budget_mbps, latency, ctl.group_mbps);
+		}
+		rounds++;
+	}
+
+	reset_budgets(fd);
+
+	if ( ctl.verbose && !getrusage(RUSAGE_SELF, &usage_info) ) {
+		fprintf(stderr, "%d rounds, %.3f ms of CPU time per round\n", rounds,
+				rounds ? (usage_info.ru_utime.tv_sec + usage_info.ru_stime.tv_sec +
+				(usage_info.ru_utime.tv_usec + usage_info.ru_stime.tv_usec) / 1e6) * 1e3 / rounds : 0.0);
+	}
+
+	munmap(telemetry, (size_t)nr_cpus * ARCHMON_RING_BYTES);
+	close(fd);
+
+	return EXIT_SUCCESS;
+}
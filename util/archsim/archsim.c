@@ -0,0 +1,499 @@
+/*
+ * archsim: replays per-CPU miss traces through the regulator's credit
+ * policy (regulator.h) to compare budget policies offline
+ *
+ * A trace has one line per period and one column per CPU with the misses
+ * (or bytes, in traffic mode) the CPU would make if it was never throttled,
+ * e.g. the 'used' column of unthrottled telemetry records. Lines starting
+ * with '#' are ignored. Virtual CPUs past the last column reuse columns
+ * round robin.
+ *
+ * Misses a throttled CPU could not make are delayed, not dropped: they
+ * are made as soon as there is credit again.
+ *
+ * Author: Jeongseob Ahn (ahnjeong@umich.edu)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "regulator.h"
+
+#define MAX_POLICIES	8
+#define MAX_CREDITS	64
+
+struct policy {
+	const char	*name;
+	unsigned int	reclaim:1,	/* unused credit goes to the other CPUs */
+			bucket:1,	/* token bucket */
+			adaptive:1;	/* adaptive period */
+};
+
+static const struct policy policies[] = {
+	{ "static",	0, 0, 0 },
+	{ "reclaim",	1, 0, 0 },
+	{ "bucket",	0, 1, 0 },
+	{ "adaptive",	0, 0, 1 },
+	{ "all",	1, 1, 1 },
+};
+
+struct trace {
+	u64		*misses;	/* nr_periods x nr_cols */
+	size_t		nr_periods;
+	int		nr_cols;
+};
+
+struct config {
+	int		nr_cpus;
+	u64		limit;		/* per-CPU, per period, 0: none */
+	unsigned int	burst_periods;
+	u64		period_ns;
+	unsigned int	unit;		/* bytes per miss, 1 in traffic mode */
+};
+
+struct vcpu {
+	u64		pending;	/* misses waiting for credit */
+	u64		credit;		/* left in the window */
+	u64		period_credit;	/* granted in the window, reclaim included */
+	u64		grant;		/* granted at the start of the window */
+	u64		window_used;
+	int		period_shift;
+	int		window_left;	/* periods to the end of the window */
+	bool		idle;
+	bool		throttled;
+
+	u64		demand;
+	u64		used;
+	u64		throttle_ns;
+};
+
+struct run {
+	const struct policy *policy;
+	u64		credit;		/* per-CPU credit per period */
+
+	/* Results */
+	double		bandwidth;	/* MB/s */
+	double		demand;		/* MB/s */
+	double		throttle;	/* % of CPU time */
+	double		fairness;	/* Jain's index of used/demand */
+	u64		backlog;
+};
+
+static struct trace trace;
+static struct config config = {
+	.burst_periods = 10,
+	.period_ns = 1000000,
+	.unit = 64,
+};
+
+static struct run runs[MAX_POLICIES * MAX_CREDITS];
+static int nr_runs;
+static int next_run;
+
+static void usage(FILE* out)
+{
+	fprintf(out, "Usage: ./archsim [options] -c credit[,credit...] trace\n\n");
+	fprintf(out, "Options:\n"
+		" -c, per-CPU credit per period, a run per value\n"
+		" -p, policies: static,reclaim,bucket,adaptive,all (default: all of them)\n"
+		" -n, number of virtual CPUs (default: trace columns)\n"
+		" -l, per-CPU credit limit per period (default: none)\n"
+		" -b, token bucket depth in periods (default: 10)\n"
+		" -t, period in us (default: 1000)\n"
+		" -u, bytes per miss, 1 for traces in bytes (default: 64)\n"
+		" -j, threads (default: online CPUs)\n\n");
+	fprintf(out, "Prints one CSV line per policy and credit.\n");
+
+	exit(out == stderr ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int load_trace(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char *line = NULL, *p, *end;
+	size_t len = 0, capacity = 0;
+	int col;
+
+	if ( !fp ) {
+		perror(path);
+		return -1;
+	}
+
+	while ( getline(&line, &len, fp) != -1 ) {
+		if ( line[0] == '#' || line[0] == '\n' ) {
+			continue;
+		}
+
+		/* The first line sets the number of CPUs */
+		if ( !trace.nr_cols ) {
+			for ( p = line; strtoull(p, &end, 10), end != p; p = end ) {
+				trace.nr_cols++;
+			}
+			if ( !trace.nr_cols ) {
+				fprintf(stderr, "%s: no counts\n", path);
+				goto err;
+			}
+		}
+
+		if ( trace.nr_periods == capacity ) {
+			capacity = capacity ? capacity * 2 : 4096;
+			trace.misses = realloc(trace.misses, capacity * trace.nr_cols * sizeof(u64));
+			if ( !trace.misses ) {
+				perror("realloc");
+				goto err;
+			}
+		}
+
+		p = line;
+		for ( col = 0; col < trace.nr_cols; col++ ) {
+			trace.misses[trace.nr_periods * trace.nr_cols + col] = strtoull(p, &end, 10);
+			if ( end == p ) {
+				fprintf(stderr, "%s: period %zu has %d counts instead of %d\n",
+						path, trace.nr_periods + 1, col, trace.nr_cols);
+				goto err;
+			}
+			p = end;
+		}
+		trace.nr_periods++;
+	}
+
+	free(line);
+	fclose(fp);
+	return trace.nr_periods ? 0 : -1;
+
+err:
+	free(line);
+	fclose(fp);
+	return -1;
+}
+
+/*
+ *	Period boundary of a CPU whose window ended, as in do_archmon_period_timer().
+ *	Returns the credit it gives away.
+ */
+static u64 vcpu_refill(struct vcpu *cpu, const struct policy *policy, u64 credit_per_period)
+{
+	u64 unused = cpu->credit;
+	u64 depth = 0;
+	bool idle;
+
+	if ( policy->adaptive ) {
+		if ( cpu->throttled ) {
+			cpu->period_shift = 0;
+		} else {
+			cpu->period_shift = archmon_adapt_shift(cpu->period_shift, cpu->window_used, cpu->grant, &idle);
+			cpu->idle = idle;
+		}
+	}
+
+	if ( policy->bucket ) {
+		depth = archmon_bucket_depth(0, credit_per_period, config.burst_periods);
+	}
+
+	cpu->credit = archmon_refill_credit(credit_per_period, cpu->period_shift, 1U << CACHE_SCALE_SHIFT,
+			depth, config.limit, &unused);
+	cpu->period_credit = cpu->credit;
+	cpu->grant = cpu->credit;
+	cpu->window_used = 0;
+	cpu->window_left = 1 << cpu->period_shift;
+	cpu->throttled = false;
+
+	return unused;
+}
+
+/*
+ *	An idle CPU missed again: it starts over with a single period, like
+ *	archmon_wake()
+ */
+static void vcpu_wake(struct vcpu *cpu, u64 credit_per_period)
+{
+	cpu->idle = false;
+	cpu->period_shift = 0;
+	cpu->credit = credit_per_period;
+	cpu->period_credit = credit_per_period;
+	cpu->grant = credit_per_period;
+	cpu->window_used = 0;
+	cpu->window_left = 1;
+	cpu->throttled = false;
+}
+
+/*
+ *	Make the misses of one period, borrowing from the pool once out of
+ *	credit as archmon_reclaim_credit() does
+ */
+static void vcpu_period(struct vcpu *cpu, const struct policy *policy, u64 credit_per_period, u64 demand, u64 *pool)
+{
+	u64 wanted, use, chunk, take, allowance;
+	int nr_periods = 1 << cpu->period_shift;
+
+	cpu->demand += demand;
+	cpu->pending += demand;
+	wanted = cpu->pending;
+
+	while ( policy->reclaim && *pool && cpu->pending > cpu->credit ) {
+		chunk = archmon_reclaim_chunk(credit_per_period, cpu->period_credit, 1U << CACHE_SCALE_SHIFT,
+				config.limit << cpu->period_shift);
+		if ( !chunk ) {
+			break;
+		}
+
+		take = archmon_min_credit(chunk, *pool);
+		*pool -= take;
+		cpu->credit += take;
+		cpu->period_credit += take;
+	}
+
+	/* A window is paced per period, like the slices of do_archmon_slice_timer() */
+	allowance = archmon_slice_allowance(cpu->grant, cpu->period_credit - cpu->grant, 
+			nr_periods - cpu->window_left, nr_periods);
+	use = archmon_min_credit(cpu->pending, cpu->credit);
+	use = archmon_min_credit(use, allowance > cpu->window_used ? allowance - cpu->window_used : 0);
+	cpu->credit -= use;
+	cpu->pending -= use;
+	cpu->window_used += use;
+	cpu->used += use;
+
+	/* At a steady miss rate, the credit runs out 'use / wanted' into the period */
+	if ( cpu->pending ) {
+		cpu->throttled = true;
+		cpu->throttle_ns += config.period_ns - (u64)((double)config.period_ns * use / wanted);
+	}
+
+	cpu->window_left--;
+}
+
+static void simulate(struct run *run)
+{
+	const struct policy *policy = run->policy;
+	struct vcpu *cpus = calloc(config.nr_cpus, sizeof(*cpus));
+	double sum = 0, sum_sq = 0, seconds, total_used = 0, total_demand = 0, total_throttle = 0;
+	size_t period;
+	u64 pool, demand;
+	int i, cpu_id, nr_fair = 0;
+
+	if ( !cpus ) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for ( period = 0; period < trace.nr_periods; period++ ) {
+		const u64 *misses = &trace.misses[period * trace.nr_cols];
+
+		/* The pool is emptied at every boundary */
+		pool = 0;
+		for ( cpu_id = 0; cpu_id < config.nr_cpus; cpu_id++ ) {
+			struct vcpu *cpu = &cpus[cpu_id];
+
+			if ( cpu->idle ) {
+				if ( misses[cpu_id % trace.nr_cols] ) {
+					vcpu_wake(cpu, run->credit);
+				}
+			} else if ( !cpu->window_left ) {
+				u64 unused = vcpu_refill(cpu, policy, run->credit);
+
+				if ( policy->reclaim ) {
+					pool += unused;
+				}
+			}
+		}
+
+		/* Start with a different CPU every period, nobody borrows first all the time */
+		for ( i = 0; i < config.nr_cpus; i++ ) {
+			cpu_id = (i + period) % config.nr_cpus;
+			demand = misses[cpu_id % trace.nr_cols];
+
+			if ( cpus[cpu_id].idle ) {
+				cpus[cpu_id].demand += demand;
+				continue;
+			}
+			vcpu_period(&cpus[cpu_id], policy, run->credit, demand, &pool);
+		}
+	}
+
+	seconds = (double)trace.nr_periods * config.period_ns / 1e9;
+	for ( cpu_id = 0; cpu_id < config.nr_cpus; cpu_id++ ) {
+		struct vcpu *cpu = &cpus[cpu_id];
+
+		total_used += cpu->used;
+		total_demand += cpu->demand;
+		total_throttle += cpu->throttle_ns;
+		run->backlog += cpu->pending;
+
+		if ( cpu->demand ) {
+			double share = (double)cpu->used / cpu->demand;
+
+			sum += share;
+			sum_sq += share * share;
+			nr_fair++;
+		}
+	}
+
+	run->bandwidth = total_used * config.unit / seconds / 1e6;
+	run->demand = total_demand * config.unit / seconds / 1e6;
+	run->throttle = 100.0 * total_throttle / ((double)trace.nr_periods * config.period_ns * config.nr_cpus);
+	run->fairness = sum_sq > 0 ? sum * sum / (nr_fair * sum_sq) : 1.0;
+
+	free(cpus);
+}
+
+static void *worker(void *arg)
+{
+	int i;
+
+	while ( (i = __sync_fetch_and_add(&next_run, 1)) < nr_runs ) {
+		simulate(&runs[i]);
+	}
+
+	return NULL;
+}
+
+static int parse_policies(char *list, const struct policy **selected)
+{
+	char *name, *saveptr = NULL;
+	int nr = 0, i;
+
+	for ( name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr) ) {
+		for ( i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++ ) {
+			if ( !strcmp(name, policies[i].name) ) {
+				break;
+			}
+		}
+
+		if ( i == (int)(sizeof(policies) / sizeof(policies[0])) || nr == MAX_POLICIES ) {
+			fprintf(stderr, "unknown policy %s\n", name);
+			return -1;
+		}
+		selected[nr++] = &policies[i];
+	}
+
+	return nr;
+}
+
+static int parse_credits(char *list, u64 *credits)
+{
+	char *value, *end, *saveptr = NULL;
+	int nr = 0;
+
+	for ( value = strtok_r(list, ",", &saveptr); value; value = strtok_r(NULL, ",", &saveptr) ) {
+		if ( nr == MAX_CREDITS ) {
+			fprintf(stderr, "at most %d credits\n", MAX_CREDITS);
+			return -1;
+		}
+
+		credits[nr] = strtoull(value, &end, 10);
+		if ( *end || !credits[nr] ) {
+			fprintf(stderr, "invalid credit %s\n", value);
+			return -1;
+		}
+		nr++;
+	}
+
+	return nr;
+}
+
+int main(int argc, char **argv)
+{
+	const struct policy *selected[MAX_POLICIES];
+	u64 credits[MAX_CREDITS];
+	int nr_policies = 0, nr_credits = 0, nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t *threads;
+	int c, i, j;
+
+	while ((c = getopt(argc, argv, "c:p:n:l:b:t:u:j:h")) != -1) {
+		switch (c) {
+		case 'c':
+			nr_credits = parse_credits(optarg, credits);
+			break;
+		case 'p':
+			nr_policies = parse_policies(optarg, selected);
+			break;
+		case 'n':
+			config.nr_cpus = atoi(optarg);
+			break;
+		case 'l':
+			config.limit = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			config.burst_periods = atoi(optarg);
+			break;
+		case 't':
+			config.period_ns = strtoull(optarg, NULL, 10) * 1000;
+			break;
+		case 'u':
+			config.unit = atoi(optarg);
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		case 'h':
+			usage(stdout);
+			break;
+		default:
+			usage(stderr);
+			break;
+		}
+	}
+
+	if ( optind != argc - 1 || nr_credits <= 0 || nr_policies < 0 || !config.period_ns || config.unit < 1 ) {
+		usage(stderr);
+	}
+
+	if ( !nr_policies ) {
+		for ( i = 0; i < (int)(sizeof(policies) / sizeof(policies[0])); i++ ) {
+			selected[nr_policies++] = &policies[i];
+		}
+	}
+
+	if ( load_trace(argv[optind]) ) {
+		fprintf(stderr, "cannot load %s\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if ( config.nr_cpus <= 0 ) {
+		config.nr_cpus = trace.nr_cols;
+	}
+
+	for ( i = 0; i < nr_policies; i++ ) {
+		for ( j = 0; j < nr_credits; j++ ) {
+			runs[nr_runs].policy = selected[i];
+			runs[nr_runs].credit = credits[j];
+			nr_runs++;
+		}
+	}
+
+	/* Runs are independent, each thread takes the next one */
+	nr_threads = nr_threads < 1 ? 1 : (nr_threads > nr_runs ? nr_runs : nr_threads);
+	threads = calloc(nr_threads, sizeof(*threads));
+	if ( !threads ) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	for ( i = 0; i < nr_threads; i++ ) {
+		if ( pthread_create(&threads[i], NULL, worker, NULL) ) {
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+
+	for ( i = 0; i < nr_threads; i++ ) {
+		pthread_join(threads[i], NULL);
+	}
+
+	printf("policy,credit,cpus,periods,bandwidth_mbps,demand_mbps,throttle_pct,fairness,backlog\n");
+	for ( i = 0; i < nr_runs; i++ ) {
+		printf("%s,%llu,%d,%zu,%.1f,%.1f,%.2f,%.4f,%llu\n", runs[i].policy->name,
+				(unsigned long long)runs[i].credit, config.nr_cpus, trace.nr_periods,
+				runs[i].bandwidth, runs[i].demand, runs[i].throttle, runs[i].fairness,
+				(unsigned long long)runs[i].backlog);
+	}
+
+	free(threads);
+	free(trace.misses);
+
+	return EXIT_SUCCESS;
+}